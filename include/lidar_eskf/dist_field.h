@@ -0,0 +1,374 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef DIST_FIELD_H
+#define DIST_FIELD_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <dynamicEDT3D/dynamicEDTOctomap.h>
+#include <octomap/OcTree.h>
+#include "lidar_eskf/morton.h"
+
+// grid mask values returned by get_gridmask()
+enum GridMask {
+    GRID_FREE     = 0,
+    GRID_OCCUPIED = 1,
+    GRID_UNKNOWN  = 2
+};
+
+// memory order of the cells of the dense grid backends
+enum GridLayout {
+    LAYOUT_LINEAR = 0, // row major, x fastest
+    LAYOUT_MORTON = 1  // 8x8x8 bricks in row major order, Z-order inside a brick
+};
+
+// Abstract distance field queried by the particle weighting. Every backend
+// answers with the same semantics as DynamicEDTOctomap: distance in meters
+// to the closest occupied voxel, saturated at max_dist, and -1.0 outside the
+// bounding box.
+class DistField
+{
+public:
+    virtual ~DistField() {}
+
+    virtual std::string name() const = 0;
+
+    // build the field over the voxels of tree inside [min, max]
+    virtual void build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                       const octomap::point3d &min,
+                       const octomap::point3d &max,
+                       double max_dist) = 0;
+    // refresh the field after the octree has been modified
+    virtual void update() = 0;
+    // refresh the field after the octree has been modified inside [min, max]
+    virtual void update_region(const octomap::point3d &min, const octomap::point3d &max) { update(); }
+
+    virtual double get_dist(const octomap::point3d &p) const = 0;
+    virtual char get_gridmask(const octomap::point3d &p) const = 0;
+
+    // batched lookup over n points given as separate coordinate arrays
+    virtual void get_dist(const float *x, const float *y, const float *z, int n,
+                          float *dist, char *mask) const;
+
+    // batched trilinear interpolation of the distance between the centers
+    // of the voxels of size resolution around each point, with its gradient.
+    // Points next to the border of the field get dist -1 and no gradient.
+    void get_dist_grad(const float *x, const float *y, const float *z, int n, float resolution,
+                       float *dist, float *gx, float *gy, float *gz) const;
+
+    // batched lookup of the voxels with octree keys (kx, ky, kz)
+    virtual void get_dist_keys(const int *kx, const int *ky, const int *kz, int n,
+                               float *dist, char *mask) const = 0;
+
+    // batched log-likelihood of n end points under a normal distribution of
+    // the distance, truncated at 2*sigma in known and 0.5*sigma in unknown space
+    void get_log_likelihood(const float *x, const float *y, const float *z, int n,
+                            double sigma, float *ll) const;
+    // same for end points given by their octree keys
+    void get_log_likelihood_keys(const int *kx, const int *ky, const int *kz, int n,
+                                 double sigma, float *ll) const;
+
+    // batched sphere tracing of n rays from origin along the unit
+    // directions (dx, dy, dz): each ray advances by the distance to the
+    // nearest obstacle until it lands in an occupied cell. range is the
+    // distance travelled, or -1 if the ray leaves the field or max_range.
+    // resolution is the cell size, it bounds the step near obstacles.
+    void cast_rays(const octomap::point3d &origin,
+                   const float *dx, const float *dy, const float *dz, int n,
+                   float max_range, float resolution, float *range) const;
+
+    // approximate number of bytes held by the field
+    virtual size_t memory_usage() const = 0;
+
+    // prepare the field around a position that will be queried soon
+    virtual void warm_up(const octomap::point3d &center, double radius) {}
+};
+
+// Wraps the original DynamicEDTOctomap + OcTree lookups.
+class EDTField : public DistField
+{
+public:
+    EDTField() {}
+
+    std::string name() const { return "edt"; }
+    void build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+               const octomap::point3d &min,
+               const octomap::point3d &max,
+               double max_dist);
+    void update();
+    double get_dist(const octomap::point3d &p) const;
+    char get_gridmask(const octomap::point3d &p) const;
+    void get_dist_keys(const int *kx, const int *ky, const int *kz, int n,
+                       float *dist, char *mask) const;
+    size_t memory_usage() const;
+
+    boost::shared_ptr<DynamicEDTOctomap> get_edt() const { return _edt_ptr; }
+
+private:
+    boost::shared_ptr<octomap::OcTree> _tree_ptr;
+    boost::shared_ptr<DynamicEDTOctomap> _edt_ptr;
+    size_t _num_cells;
+};
+
+// Common part of the backends that sample the field on the finest octree
+// voxels inside the bounding box. Cell (0,0,0) is the voxel of min.
+class GridField : public DistField
+{
+public:
+    GridField() : _size_x(0), _size_y(0), _size_z(0), _max_dist(0.0), _max_sq_dist(0),
+                  _layout(LAYOUT_LINEAR), _bricks_x(0), _bricks_y(0), _bricks_z(0) {}
+
+    // storage order used by the dense backends, set before build()
+    void set_layout(GridLayout layout) { _layout = layout; }
+
+    void build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+               const octomap::point3d &min,
+               const octomap::point3d &max,
+               double max_dist);
+    void update();
+    void update_region(const octomap::point3d &min, const octomap::point3d &max);
+    double get_dist(const octomap::point3d &p) const;
+    char get_gridmask(const octomap::point3d &p) const;
+    void get_dist(const float *x, const float *y, const float *z, int n,
+                  float *dist, char *mask) const;
+    void get_dist_keys(const int *kx, const int *ky, const int *kz, int n,
+                       float *dist, char *mask) const;
+
+    // points handled per gather() call by the batched lookup
+    static const int BATCH_SIZE = 64;
+
+protected:
+    void init_geometry(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                       const octomap::point3d &min,
+                       const octomap::point3d &max,
+                       double max_dist);
+    // distances and masks of the cells in [x0,x1) x [y0,y1) x [z0,z1),
+    // stored x fastest, including obstacles outside of the box
+    void compute_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                        std::vector<float> &dist, std::vector<char> &mask) const;
+
+    // cells whose distance can change when the octree changes inside
+    // [min, max], returns false if there are none
+    bool region_cells(const octomap::point3d &min, const octomap::point3d &max,
+                      int &x0, int &y0, int &z0, int &x1, int &y1, int &z1) const;
+
+    // store the dense float distances and masks in the backend format
+    virtual void store(const std::vector<float> &dist, const std::vector<char> &mask) = 0;
+    // overwrite the cells in [x0,x1) x [y0,y1) x [z0,z1) after store()
+    virtual void store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                              const std::vector<float> &dist, const std::vector<char> &mask) = 0;
+    virtual float cell_dist(int ix, int iy, int iz) const = 0;
+    virtual char cell_mask(int ix, int iy, int iz) const = 0;
+    // look up n <= BATCH_SIZE cells, indices may be out of the grid
+    virtual void gather(const int *ix, const int *iy, const int *iz, int n,
+                        float *dist, char *mask) const = 0;
+
+    inline bool in_grid(int ix, int iy, int iz) const {
+        return unsigned(ix) < unsigned(_size_x) &&
+               unsigned(iy) < unsigned(_size_y) &&
+               unsigned(iz) < unsigned(_size_z);
+    }
+
+    // returns false if p falls outside of the grid
+    inline bool cell_index(double x, double y, double z, int &ix, int &iy, int &iz) const {
+        ix = int(floor(x * _inv_resolution)) + 32768 - _min_key[0];
+        iy = int(floor(y * _inv_resolution)) + 32768 - _min_key[1];
+        iz = int(floor(z * _inv_resolution)) + 32768 - _min_key[2];
+        return in_grid(ix, iy, iz);
+    }
+    inline size_t linear_index(int ix, int iy, int iz) const {
+        return (size_t(iz) * _size_y + iy) * _size_x + ix;
+    }
+    // index of a cell in the storage of the dense backends
+    inline size_t storage_index(int ix, int iy, int iz) const {
+        if(_layout == LAYOUT_MORTON) {
+            size_t brick = (size_t(iz >> 3) * _bricks_y + (iy >> 3)) * _bricks_x + (ix >> 3);
+            return (brick << 9) | morton_brick(ix, iy, iz);
+        }
+        return linear_index(ix, iy, iz);
+    }
+    inline size_t storage_size() const {
+        if(_layout == LAYOUT_MORTON) {
+            return (size_t(_bricks_x) * _bricks_y * _bricks_z) << 9;
+        }
+        return size_t(_size_x) * _size_y * _size_z;
+    }
+
+    boost::shared_ptr<octomap::OcTree> _tree_ptr;
+    octomap::point3d _min, _max;
+    octomap::OcTreeKey _min_key;
+    int _size_x, _size_y, _size_z;
+    double _resolution, _inv_resolution;
+    double _max_dist;
+    int _max_sq_dist;
+    GridLayout _layout;
+    int _bricks_x, _bricks_y, _bricks_z;
+};
+
+// Dense float distance grid plus one mask byte per cell.
+class DenseField : public GridField
+{
+public:
+    std::string name() const { return "dense"; }
+    size_t memory_usage() const;
+
+protected:
+    void store(const std::vector<float> &dist, const std::vector<char> &mask);
+    void store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                      const std::vector<float> &dist, const std::vector<char> &mask);
+    float cell_dist(int ix, int iy, int iz) const { return _dist[storage_index(ix, iy, iz)]; }
+    char cell_mask(int ix, int iy, int iz) const { return _mask[storage_index(ix, iy, iz)]; }
+    void gather(const int *ix, const int *iy, const int *iz, int n,
+                float *dist, char *mask) const;
+
+private:
+    std::vector<float> _dist;
+    std::vector<char>  _mask;
+};
+
+// Sparse grid of 8x8x8 blocks. Blocks whose cells are all saturated and
+// share one mask value are not allocated and answer from the block table.
+// The blocks always use their own layout, set_layout() has no effect.
+class BlockField : public GridField
+{
+public:
+    BlockField() : _blocks_x(0), _blocks_y(0), _blocks_z(0), _sat_dist(0.0f) {}
+
+    std::string name() const { return "block"; }
+    size_t memory_usage() const;
+
+    static const int BLOCK_BITS = 3;
+    static const int BLOCK_SIZE = 1 << BLOCK_BITS;
+    static const int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+protected:
+    void store(const std::vector<float> &dist, const std::vector<char> &mask);
+    void store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                      const std::vector<float> &dist, const std::vector<char> &mask);
+    float cell_dist(int ix, int iy, int iz) const;
+    char cell_mask(int ix, int iy, int iz) const;
+    void gather(const int *ix, const int *iy, const int *iz, int n,
+                float *dist, char *mask) const;
+
+private:
+    struct Block {
+        float dist[BLOCK_CELLS];
+        char  mask[BLOCK_CELLS];
+    };
+    inline size_t block_index(int ix, int iy, int iz) const {
+        return (size_t(iz >> BLOCK_BITS) * _blocks_y + (iy >> BLOCK_BITS)) * _blocks_x + (ix >> BLOCK_BITS);
+    }
+    inline int cell_offset(int ix, int iy, int iz) const {
+        const int m = BLOCK_SIZE - 1;
+        return (((iz & m) << BLOCK_BITS) + (iy & m)) * BLOCK_SIZE + (ix & m);
+    }
+
+    int _blocks_x, _blocks_y, _blocks_z;
+    float _sat_dist;
+    // index into _blocks, or -1 for an unallocated block
+    std::vector<boost::int32_t> _table;
+    // mask of unallocated blocks
+    std::vector<char> _table_mask;
+    std::vector<Block> _blocks;
+};
+
+// Dense grid with one integer per cell: the two top bits hold the mask and
+// the remaining bits the distance quantized over [0, max_dist]. T is
+// boost::uint8_t (63 levels) or boost::uint16_t (16383 levels).
+template <typename T>
+class QuantField : public GridField
+{
+public:
+    std::string name() const { return sizeof(T) == 1 ? "quant8" : "quant16"; }
+    size_t memory_usage() const;
+
+    static const int MASK_SHIFT = 8 * sizeof(T) - 2;
+    static const T   DIST_MASK  = (T(1) << MASK_SHIFT) - 1;
+
+protected:
+    void store(const std::vector<float> &dist, const std::vector<char> &mask);
+    void store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                      const std::vector<float> &dist, const std::vector<char> &mask);
+    float cell_dist(int ix, int iy, int iz) const {
+        return (_cells[storage_index(ix, iy, iz)] & DIST_MASK) * _scale;
+    }
+    char cell_mask(int ix, int iy, int iz) const {
+        return _cells[storage_index(ix, iy, iz)] >> MASK_SHIFT;
+    }
+    void gather(const int *ix, const int *iy, const int *iz, int n,
+                float *dist, char *mask) const;
+
+private:
+    std::vector<T> _cells;
+    float _scale;
+};
+
+// Grid of 16x16x16 blocks computed the first time a query lands in them,
+// from the octree around the block padded by the saturation distance.
+// Blocks are published atomically, so queries may come from several
+// threads. update() drops all blocks, update_region() only the blocks
+// the change can reach.
+class LazyField : public GridField
+{
+public:
+    LazyField() : _num_blocks(0), _blocks_x(0), _blocks_y(0), _blocks_z(0), _num_computed(0) {}
+    ~LazyField() { clear(); }
+
+    std::string name() const { return "lazy"; }
+    void build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+               const octomap::point3d &min,
+               const octomap::point3d &max,
+               double max_dist);
+    void update();
+    void update_region(const octomap::point3d &min, const octomap::point3d &max);
+    void warm_up(const octomap::point3d &center, double radius);
+    size_t memory_usage() const;
+
+    static const int BLOCK_BITS = 4;
+    static const int BLOCK_SIZE = 1 << BLOCK_BITS;
+    static const int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+protected:
+    void store(const std::vector<float> &dist, const std::vector<char> &mask) {}
+    void store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                      const std::vector<float> &dist, const std::vector<char> &mask) {}
+    float cell_dist(int ix, int iy, int iz) const;
+    char cell_mask(int ix, int iy, int iz) const;
+    void gather(const int *ix, const int *iy, const int *iz, int n,
+                float *dist, char *mask) const;
+
+private:
+    struct Block {
+        float dist[BLOCK_CELLS];
+        char  mask[BLOCK_CELLS];
+    };
+    inline int cell_offset(int ix, int iy, int iz) const {
+        const int m = BLOCK_SIZE - 1;
+        return (((iz & m) << BLOCK_BITS) + (iy & m)) * BLOCK_SIZE + (ix & m);
+    }
+    // block of a cell inside the grid, computed on first use
+    const Block* get_block(int ix, int iy, int iz) const;
+    void clear();
+
+    size_t _num_blocks;
+    int _blocks_x, _blocks_y, _blocks_z;
+    boost::scoped_array<std::atomic<Block*> > _table;
+    mutable std::atomic<size_t> _num_computed;
+};
+
+// Returns a new backend for type "edt", "dense", "block", "quant8" (or
+// "quant"), "quant16" and "lazy", or NULL if the type is unknown.
+DistField* create_dist_field(const std::string &type);
+
+#endif // DIST_FIELD_H
@@ -0,0 +1,24 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef EDT_H
+#define EDT_H
+
+#include <vector>
+
+// Exact squared Euclidean distance transform of a 3D grid stored x fastest
+// (Felzenszwalb and Huttenlocher). The three separable passes are
+// parallelized with OpenMP across lines and slabs.
+//
+// sq_dist is set to the squared distance in cells from every cell to the
+// closest occupied cell, or to +inf if that is larger than max_sq_dist.
+void squared_edt(const std::vector<char> &occupied,
+                 int size_x, int size_y, int size_z,
+                 float max_sq_dist,
+                 std::vector<float> &sq_dist);
+
+#endif // EDT_H
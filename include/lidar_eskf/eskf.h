@@ -24,8 +24,17 @@
 #include <tf/transform_listener.h>
 #include <tf_conversions/tf_eigen.h>
 #include <vector>
+#include <algorithm>
 #include <numeric>
 
+// nominal pose after an imu step, for the pose history
+struct PoseSample {
+    ros::Time time;
+    Eigen::Vector3d position;
+    Eigen::Quaterniond rotation;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
 class ESKF {
 public:
     ESKF(ros::NodeHandle &nh);
@@ -40,11 +49,23 @@ public:
     void get_mean_pose(Eigen::Matrix<double, 6, 1> &mean_pose);
     void get_mean_pose(Eigen::Matrix<double, 7, 1> &mean_pose);
     void get_cov_pose(Eigen::Matrix<double, 6, 6> &cov_pose);
+    void get_velocity(Eigen::Vector3d &velocity);
+    // nominal pose [p, q] at time t, interpolated in the pose history and
+    // the newest pose past its end; false if t is older than the history
+    bool get_pose_at(const ros::Time &t, Eigen::Matrix<double, 7, 1> &pose);
+    // time of the newest pose, the one get_mean_pose() returns; false
+    // before the first imu message
+    bool get_latest_pose_time(ros::Time &t) const;
+    // true while a measurement waits for the next imu message
+    bool has_pending_meas() const { return _got_measurements; }
     void publish_odom();
     void publish_bias();
 
     void update_meas_mean(Eigen::Matrix<double, 6, 1> &mean_meas);
     void update_meas_cov(Eigen::Matrix<double, 6, 6> &cov_meas);
+    // pose measurement in information form: z = W^T [dp; dtheta] + n with
+    // n ~ N(0, I); zero columns of W carry no information
+    void update_meas_info(const Eigen::Matrix<double, 6, 6> &W, const Eigen::Matrix<double, 6, 1> &z);
     void update_meas_flag();
     void update_error();
     void update_state();
@@ -109,12 +130,22 @@ private:
     bool _got_measurements;
 
     Eigen::Matrix<double, 6, 6> _m_pose_sigma;
+    bool _m_info_form;
+    Eigen::Matrix<double, 6, 6> _m_info_sqrt;
+    Eigen::Matrix<double, 6, 1> _m_info_z;
 
     // a queue to smooth imu accleration measurements
     std::vector<geometry_msgs::Vector3> _acc_queue;
     int _acc_queue_size;
     int _acc_queue_count;
 
+    // startup timing
+    ros::WallTime _start_time;
+    bool _first_odom;
+
+    // recent nominal poses, one per imu message
+    boost::circular_buffer<PoseSample, Eigen::aligned_allocator<PoseSample> > _pose_history;
+
     // log of odom
     std::vector<nav_msgs::Odometry> _odom_vec;
     
@@ -143,4 +174,15 @@ Eigen::Matrix3d skew(Eigen::Vector3d w);
 Eigen::Matrix3d angle_axis_to_rotation_matrix(Eigen::Vector3d w);
 Eigen::Matrix3d euler_angle_to_rotation_matrix(Eigen::Vector3d w);
 
+// Kalman update of the error state covariance Sigma, around a zero error
+// mean, with a pose measurement y ~ N([dp; dtheta], R). Returns the error
+// state estimate.
+Eigen::Matrix<double, 15, 1> update_pose_cov(const Eigen::Matrix<double, 6, 1> &y,
+                                             const Eigen::Matrix<double, 6, 6> &R,
+                                             Eigen::Matrix<double, 15, 15> &Sigma);
+// same with the whitened measurement of ESKF::update_meas_info()
+Eigen::Matrix<double, 15, 1> update_pose_info(const Eigen::Matrix<double, 6, 6> &W,
+                                              const Eigen::Matrix<double, 6, 1> &z,
+                                              Eigen::Matrix<double, 15, 15> &Sigma);
+
 #endif // IMUODOM_H
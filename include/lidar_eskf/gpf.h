@@ -13,23 +13,56 @@
 #include <sensor_msgs/LaserScan.h>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
+#include <std_msgs/Float32.h>
 #include <pcl/keypoints/uniform_sampling.h>
 #include <pcl/filters/passthrough.h>
 #include <pcl/filters/conditional_removal.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/common/centroid.h>
 #include <visualization_msgs/MarkerArray.h>
-#include <laser_geometry/laser_geometry.h>
 #include <tf/transform_broadcaster.h>
 #include <pcl_ros/transforms.h>
 #include <algorithm>
 #include <numeric>
 #include <functional>
 #include <iostream>
-#include <deque>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #include "lidar_eskf/eskf.h"
 #include "lidar_eskf/particles.h"
+#include "lidar_eskf/morton.h"
+
+// clouds in the robot frame at their stamps
+typedef std::vector<std::pair<ros::Time, pcl::PointCloud<pcl::PointXYZ>::Ptr> > CloudSlices;
+
+// One of several lidars weighted together. The mount is assumed fixed,
+// the extrinsic is looked up once.
+struct LidarSensor {
+    std::string topic;
+    ros::Subscriber sub;
+    bool extrinsic_cached;
+    Eigen::Matrix3f rotation;
+    Eigen::Vector3f translation;
+    // last cloud not yet corrected, robot frame
+    ros::Time stamp;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr pending;
+};
+
+// Snapshot of one correction for the debug publisher thread. Only what
+// has subscribers is filled in.
+struct DebugFrame {
+    ros::Time stamp;
+    Eigen::Matrix<double, 7, 1> pose;
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud;
+    std::vector<Eigen::Vector3f> particles;
+    std::vector<float> weights;
+    double min_weight;
+    double max_weight;
+};
 
 class GPF {
 public:
@@ -38,18 +71,71 @@ public:
 
     void pozyx_callback(const geometry_msgs::PoseWithCovariance &msg);
     void cloud_callback(const sensor_msgs::PointCloud2 &msg);
+    // clouds and scans in the robot frame are deskewed here, if times are
+    // given, and corrected either at once or, with wedge_period, as wedges
+    // of a sweep; a wedge grows until the eskf has applied the previous one
+    void ingest(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr, const std::vector<float> &times,
+                const ros::Time &stamp);
+    // per point times in s relative to the header stamp, from the
+    // deskew_time_field scaled by deskew_time_scale and, with
+    // deskew_time_absolute, less the header stamp; false if the cloud has
+    // no such field, is big endian or has a time more than a second away
+    bool read_point_times(const sensor_msgs::PointCloud2 &msg, std::vector<float> &times);
+    // deskew() if times has one entry per point, warns otherwise
+    void deskew_timed(pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<float> &times,
+                      const ros::Time &stamp, const std::string &source);
+    // moves every point from the robot frame at its time to the one at
+    // stamp; the pose history is not extrapolated, so points newer than
+    // the last imu pose are moved as if taken at that pose
+    void deskew(pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<float> &times,
+                const ros::Time &stamp);
+    // merges slices into the robot frame at the newest eskf pose, which
+    // correct() takes its prior from, with the eskf motion in between;
+    // stamp is set to the time of that pose, or to the last slice if
+    // there is no pose history
+    pcl::PointCloud<pcl::PointXYZ>::Ptr assemble_slices(const CloudSlices &slices, ros::Time &stamp);
+    // clouds of lidar_topics, collected until every sensor reported or
+    // lidar_sync_window has passed
+    void lidar_callback(const sensor_msgs::PointCloud2ConstPtr &msg, int sensor);
+    // one correction with the pending clouds of all sensors
+    void flush_lidars();
+    void lidar_timer_callback(const ros::TimerEvent &event);
+    // one measurement update with a cloud in the robot frame at stamp, the
+    // prior is the newest eskf pose; wedges and lidar batches are moved to
+    // that pose, single clouds are taken as they are
+    void correct(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr, const ros::Time &stamp);
     void scan_callback(const sensor_msgs::LaserScan &msg);
+    // ranges straight to robot frame points with their beam times, false
+    // if the laser frame is not available
+    bool project_scan(const sensor_msgs::LaserScan &msg, pcl::PointCloud<pcl::PointXYZ> &cloud,
+                      std::vector<float> &times);
+    bool lookup_extrinsic(const std::string &frame, const ros::Time &stamp,
+                          Eigen::Matrix3f &rotation, Eigen::Vector3f &translation);
     void downsample();
-    void recover_meas();
-    void check_posdef(Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> &R);
-    void publish_cloud();
+    // drops end points that no pose within the prior margin can explain
+    void filter_outliers();
+    // keeps the point_budget points that constrain the pose best, spread
+    // over all six directions
+    void select_informative();
+    void sort_cloud();
+    // measurement that turns the sample moments into the posterior ones,
+    // false if the scan carries no usable information
+    bool recover_meas();
+    // full, reduced or no particle update for the current scan
+    enum GateDecision { GATE_FULL, GATE_LIGHT, GATE_SKIP };
+    GateDecision gate_update();
+    void use_set_size(int set_size);
     void publish_posterior();
     void publish_meas();
-    void publish_pset();
-    void publish_path();
     void publish_tf();
-    void publish_pose();
-    std::vector< std::vector<double> > compute_color(Particles pSet);
+    // hands the debug outputs of this correction to the debug thread
+    void publish_debug();
+    void debug_loop();
+    void publish_cloud(const DebugFrame &frame);
+    void publish_pset(const DebugFrame &frame);
+    void publish_path(const ros::Time &stamp, const std::vector<geometry_msgs::PoseStamped> &poses);
+    // green (min_weight) over yellow to red (max_weight)
+    void compute_color(double weight, double min_weight, double max_weight, std_msgs::ColorRGBA &color);
 
 private:
 
@@ -61,6 +147,25 @@ private:
     Eigen::Matrix<double, 6, 6> _cov_posterior;
     Eigen::Matrix<double, 6, 1> _mean_meas;
     Eigen::Matrix<double, 6, 6> _cov_meas;
+    // whitened measurement for the eskf, see ESKF::update_meas_info
+    Eigen::Matrix<double, 6, 6> _meas_info_sqrt;
+    Eigen::Matrix<double, 6, 1> _meas_info_z;
+    int _scans;
+    int _rejected_scans;
+
+    // motion gating: scans are skipped while the vehicle is slow, the
+    // covariance has not grown much since the last update and the scan
+    // still fits the map at the prior, at most for _gate_max_interval
+    bool   _gate_enabled;
+    double _gate_velocity;
+    double _gate_cov_growth;
+    double _gate_distance;
+    double _gate_max_interval;
+    int    _gate_light_size;
+    int    _active_set_size;
+    ros::Time _last_full_update;
+    double _last_cov_trace;
+    int _gated_scans[3];
 
     ros::Subscriber _pozyx_sub;
     ros::Subscriber _cloud_sub;
@@ -71,8 +176,8 @@ private:
     ros::Publisher  _post_pub;
     ros::Publisher  _path_pub;
     ros::Publisher  _pose_pub;
+    ros::Publisher  _outlier_pub;
 
-    laser_geometry::LaserProjection _projector;
     tf::TransformListener _listener;
     std::string _laser_type;
     ros::Time _laser_time;
@@ -87,9 +192,81 @@ private:
     double _ray_sigma;
     int    _set_size;
     double _cloud_range;
+    bool   _cloud_sort;
+    bool   _profile_weighting;
+    std::string _downsample_mode;
+    bool   _info_selection;
+    int    _point_budget;
+    bool   _outlier_filter;
+    double _outlier_sigmas;
+    double _outlier_max_ratio;
+    std::string _likelihood_model;
+    int    _voxel_cache_bits;
+    std::string _sampling_mode;
+    int    _rotation_samples;
+    bool   _snap_offsets;
+    int    _gn_iterations;
+    double _gn_proposal_scale;
+
+    // startup timing
+    ros::WallTime _start_time;
+    bool _first_correction;
+
+    // scan projection: trig tables of the last scan configuration and the
+    // laser frame at the first and last beam
+    bool   _scan_static_extrinsic;
+    bool   _scan_extrinsic_cached;
+    float  _scan_angle_min;
+    float  _scan_angle_increment;
+    std::vector<float> _scan_cos;
+    std::vector<float> _scan_sin;
+    Eigen::Matrix3f _scan_rotation[2];
+    Eigen::Vector3f _scan_translation[2];
+
+    // per point motion compensation with the eskf pose history
+    static const int DESKEW_KNOTS = 16;
+    bool   _deskew_enabled;
+    std::string _deskew_time_field;
+    double _deskew_time_scale;
+    bool   _deskew_time_absolute;
+
+    // slices of the current wedge in the robot frame at their stamps
+    double _wedge_period;
+    CloudSlices _wedge;
+
+    // several lidars, corrected together
+    std::vector<LidarSensor> _lidars;
+    double _lidar_sync_window;
+    // closes a batch lidar_sync_window after its first cloud arrived
+    ros::Timer _lidar_timer;
+
+    // debug outputs (particles, cloud, path) at most at _debug_rate, built
+    // and serialized on a low priority thread
+    double _debug_rate;
+    int    _path_length;
+    ros::WallTime _last_debug;
+    boost::thread _debug_thread;
+    boost::mutex _debug_mutex;
+    boost::condition_variable _debug_cond;
+    bool _debug_pending;
+    bool _debug_stop;
+    DebugFrame _debug_frame;
+    std::vector<geometry_msgs::PoseStamped> _debug_poses;
 
     nav_msgs::Path _path;
-    std::deque<geometry_msgs::PoseStamped> _pose_deque;
     tf::TransformBroadcaster _tf_br;
 };
+
+// Pose measurement that turns the sample moments into the posterior ones,
+// in the whitened form of ESKF::update_meas_info() and in covariance form
+// with variance 100 in the directions without information. False if no
+// direction is informative.
+bool recover_pose_meas(const Eigen::Matrix<double, 6, 1> &mean_sample,
+                       const Eigen::Matrix<double, 6, 6> &cov_sample,
+                       const Eigen::Matrix<double, 6, 1> &mean_posterior,
+                       const Eigen::Matrix<double, 6, 6> &cov_posterior,
+                       Eigen::Matrix<double, 6, 6> &info_sqrt,
+                       Eigen::Matrix<double, 6, 1> &info_z,
+                       Eigen::Matrix<double, 6, 1> &mean_meas,
+                       Eigen::Matrix<double, 6, 6> &cov_meas);
 #endif // GPF_H
@@ -17,36 +17,110 @@
 #include <octomap_msgs/Octomap.h>
 #include <octomap_msgs/conversions.h>
 #include <tf/transform_listener.h>
+#include <std_srvs/Empty.h>
+#include <boost/thread.hpp>
+#include <atomic>
+#include "lidar_eskf/dist_field.h"
 
 class DistMap
 {
 public:
 
     DistMap(ros::NodeHandle &nh);
-    ~DistMap(){}
+    ~DistMap();
 
     void read_mapfile();
+    // true once the octree and the distance field can be queried
+    bool is_ready() const { return _ready; }
     boost::shared_ptr<octomap::OcTree> get_map() const;
     boost::shared_ptr<DynamicEDTOctomap> get_dist_map() const;
+    boost::shared_ptr<DistField> get_dist_field() const;
     void init_dist_map();
     double ray_casting(octomap::point3d endPt, octomap::point3d originPt, octomap::point3d &rayEndPt);
+    // batched ray casting through the distance field, see DistField::cast_rays
+    void cast_rays(const octomap::point3d &origin,
+                   const float *dx, const float *dy, const float *dz, int n,
+                   float max_range, float *range);
+    double get_ray_max_range() const { return _ray_max_range; }
+    // distance at which the field saturates
+    double get_max_obstacle_dist() const { return _max_obstacle_dist; }
     double get_dist(octomap::point3d p);
     char get_gridmask(octomap::point3d p);
+
+    // batched queries over n points stored as separate x, y, z arrays
+    void get_dist(const float *x, const float *y, const float *z, int n, float *dist);
+    void get_gridmask(const float *x, const float *y, const float *z, int n, char *mask);
+    void get_log_likelihood(const float *x, const float *y, const float *z, int n,
+                            double sigma, float *ll);
+    // trilinear distance and gradient, see DistField::get_dist_grad
+    void get_dist_grad(const float *x, const float *y, const float *z, int n,
+                       float *dist, float *gx, float *gy, float *gz);
+    // same for end points given by their octree keys
+    void get_log_likelihood_keys(const int *kx, const int *ky, const int *kz, int n,
+                                 double sigma, float *ll);
+    // compute the distance field within radius of center ahead of queries,
+    // deferred until the map is ready if it is still loading
+    void warm_up(const octomap::point3d &center, double radius);
     void cloud_callback(const sensor_msgs::PointCloud2 &msg);
+
+    // octomap publishing: full snapshots on /octomap, changed voxels on
+    // /octomap_delta
+    void publish_timer_callback(const ros::TimerEvent &event);
+    bool publish_full_callback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res);
+    void publish_full(const ros::Time &stamp);
+    void publish_delta(const ros::Time &stamp);
     
 private:
 
+    // loads the map on the background thread
+    void load_map();
+    void warm_field(const octomap::point3d &center, double radius);
+
+    // batched insertion of a cloud in world frame: end point voxels are
+    // deduplicated and the free voxels along the rays found in parallel
+    void compute_update_keys(const octomap::Pointcloud &cloud, const octomap::point3d &origin,
+                             octomap::KeySet &free_cells, octomap::KeySet &occupied_cells) const;
+    // applies the keys and returns the bounding box of the changed voxels,
+    // false if there are none
+    bool apply_update_keys(const octomap::KeySet &free_cells, const octomap::KeySet &occupied_cells,
+                           octomap::point3d &changed_min, octomap::point3d &changed_max);
+    // refreshes the inner nodes above the given leafs
+    void update_inner_occupancy(const std::vector<octomap::OcTreeKey> &keys);
+
     // File name of the binary octomap (*.bt)
     std::string _map_file_name;
     double _octree_resolution;
     double _max_obstacle_dist;
+    // Distance field backend: edt, dense, block, quant8, quant16 or lazy
+    std::string _dist_backend;
+    // Cell order of the dense backends: linear or morton
+    std::string _dist_layout;
+    // Range limit of ray_casting()
+    double _ray_max_range;
+
+    // Insert map updates with the batched path instead of insertPointCloud
+    bool _batch_insert;
+
+    // Load the map on a background thread instead of in the constructor
+    bool _async_load;
+    boost::thread _load_thread;
+    std::atomic<bool> _ready;
+
+    // Warm up requested while the map was loading
+    boost::mutex _warm_mutex;
+    bool _warm_pending;
+    octomap::point3d _warm_center;
+    double _warm_radius;
 
     // Octomap pointer
     boost::shared_ptr<octomap::OcTree> _map_ptr;
 
-    // Distance map pointer
+    // Distance map pointer, only set for the edt backend
     boost::shared_ptr<DynamicEDTOctomap> _dist_map_ptr;
 
+    // Distance field used for all queries
+    boost::shared_ptr<DistField> _dist_field_ptr;
+
     // Octomap Subscriber
     ros::Subscriber _cloud_sub;
 
@@ -55,6 +129,24 @@ private:
 
     // Map Publisher
     ros::Publisher _octomap_pub;
+    ros::Publisher _octomap_delta_pub;
+    ros::ServiceServer _octomap_srv;
+    ros::Timer _publish_timer;
+
+    // full: whole octree after every update, delta: changed voxels at
+    // octomap_delta_rate and full snapshots every octomap_full_period
+    // seconds (0 = only on request)
+    std::string _publish_mode;
+    double _delta_rate;
+    double _full_period;
+
+    // voxels changed since the last delta, and whether the octree changed
+    // since the last full snapshot
+    octomap::KeySet _delta_keys;
+    bool _full_dirty;
+    bool _full_requested;
+    ros::WallTime _last_full_time;
+    ros::Time _last_update_stamp;
 
 };
 
@@ -0,0 +1,38 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <boost/cstdint.hpp>
+
+// Z-order (Morton) codes: the bits of x, y and z are interleaved so that
+// cells close in 3D are mostly close in memory.
+
+// spread the lower 21 bits of v to every third bit
+inline boost::uint64_t morton_spread(boost::uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+inline boost::uint64_t morton_encode(boost::uint32_t x, boost::uint32_t y, boost::uint32_t z) {
+    return morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+}
+
+// Morton code of a cell inside an 8x8x8 brick, only the lower 3 bits of
+// each coordinate are used.
+inline int morton_brick(int x, int y, int z) {
+    static const int spread3[8] = {0x000, 0x001, 0x008, 0x009, 0x040, 0x041, 0x048, 0x049};
+    return spread3[x & 7] | (spread3[y & 7] << 1) | (spread3[z & 7] << 2);
+}
+
+#endif // MORTON_H
@@ -9,6 +9,7 @@
 #define PARTICLES_H
 
 #include <vector>
+#include <boost/scoped_ptr.hpp>
 #include <Eigen/Dense>
 #include "pcl_ros/point_cloud.h"
 #include "pcl_ros/transforms.h"
@@ -17,6 +18,9 @@
 #include "lidar_eskf/EigenMultivariateNormal.hpp"
 #include "lidar_eskf/map.h"
 #include "lidar_eskf/eskf.h"
+#include "lidar_eskf/perf_counter.h"
+#include "lidar_eskf/voxel_cache.h"
+#include "lidar_eskf/sobol.h"
 
 #define STATE_SIZE 6
 struct Twist3d {
@@ -29,6 +33,45 @@ struct Rigid3d {
     Eigen::Quaterniond rotation;
 };
 
+// error states (translation, angle axis)
+typedef std::vector<Eigen::Matrix<double, STATE_SIZE, 1>,
+                    Eigen::aligned_allocator<Eigen::Matrix<double, STATE_SIZE, 1> > > ErrorStates;
+
+// Point cloud stored as separate coordinate arrays for the batched
+// DistMap queries.
+struct PointBuffer {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    size_t size() const { return x.size(); }
+};
+
+// Octree keys of a point cloud, stored like PointBuffer.
+struct KeyBuffer {
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> z;
+    void resize(size_t n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    size_t size() const { return x.size(); }
+};
+
+// Per thread buffers of the cached weighting.
+struct CacheScratch {
+    std::vector<boost::uint64_t> keys;
+    std::vector<int> miss;
+    PointBuffer miss_cloud;
+    std::vector<float> miss_ll;
+};
+
 struct Particle {
 //    Eigen::Matrix<double, STATE_SIZE, 1> state;
     Eigen::Vector3d translation;
@@ -52,40 +95,121 @@ public:
     void set_cov(Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> &cov);
     void set_cloud(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr);
     void set_size(int set_size);
+    void set_profiling(bool profiling);
+    // "field": distance from each end point to the nearest obstacle,
+    // "beam": measured range against the range cast through the map
+    void set_likelihood_model(const std::string &model);
+    // share end point log-likelihoods between particles through a table
+    // of 2^bits voxels, 0 disables the cache
+    void set_voxel_cache(int bits);
+    // "random": independent draws from the prior, "factorized": rotation
+    // samples times translation offsets, so that each rotated cloud is
+    // shared by the offsets. With snap_offsets the offsets are multiples of
+    // the map resolution and applied to the voxel keys directly.
+    // "sobol": scrambled Sobol points through the Cholesky factor of the
+    // prior, "cubature": randomly rotated spherical-radial cubature sets of
+    // 2 x 6 points, each matching the prior mean and covariance exactly.
+    // Call after set_size(), the set size is rounded to a multiple of
+    // rotation_samples (factorized) or of 12 (cubature).
+    void set_sampling(const std::string &mode, int rotation_samples, bool snap_offsets);
+    // Gauss-Newton on the end point distances from the prior (set_mean,
+    // set_cov and set_cloud first). Particles are then drawn from the
+    // Laplace approximation of the posterior, its covariance times scale,
+    // and weighted by prior over proposal. Returns false and keeps the
+    // prior as proposal if too few points are near obstacles.
+    bool refine_proposal(int iterations, double scale);
+    // error state mean and covariance of the last refine_proposal(), false
+    // if the prior is used
+    bool get_proposal(Eigen::Matrix<double, 6, 1> &mean, Eigen::Matrix<double, 6, 6> &cov) const;
+    // mean distance from the end points to the map at the prior mean, over
+    // the points with a known distance; -1 if there are none
+    double prior_distance();
     void draw_set();
+    void draw_set_factorized();
+    // standard normal draws for the sobol and cubature modes
+    void draw_normal_sobol(ErrorStates &z);
+    void draw_normal_cubature(ErrorStates &z);
     void weight_set();
 
     void get_posterior();
 
-    void reproject_cloud(Particle &p, pcl::PointCloud<pcl::PointXYZ> &cloud);
-    void weight_particle(Particle &p, pcl::PointCloud<pcl::PointXYZ> &cloud);
+    void reproject_cloud(Particle &p, PointBuffer &cloud);
+    // factorized sampling: cloud under a rotation sample, with its octree
+    // keys when offsets are snapped, and the cloud moved by an offset
+    void rotate_cloud(const Rigid3d &r, PointBuffer &cloud, KeyBuffer &keys);
+    void shift_cloud(const PointBuffer &cloud, const Eigen::Vector3d &offset, PointBuffer &shifted);
+    void weight_particle(Particle &p, PointBuffer &cloud, std::vector<float> &weight);
+    void weight_particle_keys(Particle &p, const KeyBuffer &keys, const Eigen::Vector3i &offset,
+                              KeyBuffer &shifted, std::vector<float> &weight);
+    void weight_particle_cached(Particle &p, PointBuffer &cloud, CacheScratch &scratch,
+                                boost::uint64_t &hits);
+    void weight_particle_beam(Particle &p, PointBuffer &cloud, std::vector<float> &weight);
 
     void propagate(Eigen::Matrix<double, 6, 1> &mean_prior,
                    Eigen::Matrix<double, 6, 6> &cov_prior,
                    Eigen::Matrix<double, 6, 1> &mean_posterior,
                    Eigen::Matrix<double, 6, 6> &cov_posterior);
-    std::vector<Particle> get_pset();
-    std::vector<Particle> get_d_pset();
+    // particles of the last propagate(), valid until the next one
+    const std::vector<Particle>& get_pset() const { return _pset; }
+    const std::vector<Particle>& get_d_pset() const { return _d_pset; }
+    // smallest and largest normalized log-weight of the last weight_set()
+    void get_weight_range(double &min_weight, double &max_weight) const;
+
+    // cache misses counted during the last weight_set(), if profiling
+    void get_cache_misses(boost::uint64_t &l1_misses, boost::uint64_t &llc_misses);
+    // voxel cache hits and lookups during the last weight_set()
+    void get_voxel_cache_stats(boost::uint64_t &hits, boost::uint64_t &lookups);
 
 private:
     std::vector<Particle> _pset;
     std::vector<Particle> _d_pset;
+    double _min_weight;
+    double _max_weight;
 
     Eigen::Matrix<double, 7, 1> _mean_prior;
     Eigen::Matrix<double, 6, 1> _mean_posterior;
 
     Eigen::Matrix<double, 6, 1> _d_mean_prior;
     Eigen::Matrix<double, 6, 6> _d_cov_prior;
+    // distribution the particles are drawn from, the prior unless refined
+    bool _use_proposal;
+    Eigen::Matrix<double, 6, 1> _d_mean_proposal;
+    Eigen::Matrix<double, 6, 6> _d_cov_proposal;
     Eigen::Matrix<double, 6, 1> _d_mean_sample;
     Eigen::Matrix<double, 6, 6> _d_cov_sample;
     Eigen::Matrix<double, 6, 1> _d_mean_posterior;
     Eigen::Matrix<double, 6, 6> _d_cov_posterior;
 
     pcl::PointCloud<pcl::PointXYZ>::Ptr _cloud_ptr;
+    PointBuffer _cloud;
+    // range of each cloud point from the robot origin
+    std::vector<float> _cloud_range;
     boost::shared_ptr<DistMap> _map_ptr;
 
     double _ray_sigma;
     int _set_size;
+    bool _beam_model;
+
+    enum SamplingMode { SAMPLING_RANDOM, SAMPLING_FACTORIZED, SAMPLING_SOBOL, SAMPLING_CUBATURE };
+    SamplingMode _sampling;
+    SobolSequence _sobol;
+
+    // factorized sampling: particle i uses rotation i / _num_offsets and
+    // offset i % _num_offsets; rotations hold the shared translation part
+    bool _snap_offsets;
+    int _num_rotations;
+    int _num_offsets;
+    std::vector<Rigid3d, Eigen::aligned_allocator<Rigid3d> > _rotation_set;
+    std::vector<Eigen::Vector3d> _offset_set;
+    std::vector<Eigen::Vector3i> _offset_keys;
+
+    boost::scoped_ptr<VoxelCache> _voxel_cache;
+    boost::uint64_t _voxel_cache_hits;
+    boost::uint64_t _voxel_cache_lookups;
+
+    bool _profiling;
+    boost::uint64_t _l1_misses;
+    boost::uint64_t _llc_misses;
 
 };
 #endif // PARTICLES_H
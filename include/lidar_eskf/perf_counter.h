@@ -0,0 +1,67 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef PERF_COUNTER_H
+#define PERF_COUNTER_H
+
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <boost/cstdint.hpp>
+
+// Hardware event counter of the calling thread (Linux perf_event_open).
+// If the kernel refuses the counter, valid() is false and stop() returns 0.
+class PerfCounter
+{
+public:
+    PerfCounter(boost::uint32_t type, boost::uint64_t config) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = type;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~PerfCounter() {
+        if(_fd >= 0) close(_fd);
+    }
+
+    bool valid() const { return _fd >= 0; }
+
+    void start() {
+        if(_fd < 0) return;
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    boost::uint64_t stop() {
+        if(_fd < 0) return 0;
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+        boost::uint64_t count = 0;
+        if(read(_fd, &count, sizeof(count)) != sizeof(count)) return 0;
+        return count;
+    }
+
+    // L1 data cache read misses
+    static boost::uint64_t l1d_read_miss() {
+        return PERF_COUNT_HW_CACHE_L1D |
+               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+private:
+    PerfCounter(const PerfCounter &);
+    PerfCounter& operator=(const PerfCounter &);
+
+    int _fd;
+};
+
+#endif // PERF_COUNTER_H
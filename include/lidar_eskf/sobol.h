@@ -0,0 +1,44 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef SOBOL_H
+#define SOBOL_H
+
+#include <boost/cstdint.hpp>
+
+// Sobol low discrepancy sequence in up to MAX_DIMS dimensions (Joe and Kuo
+// direction numbers), generated in Gray code order. A random digital shift
+// scrambles the points while keeping their stratification, so that
+// estimates over a prefix of the sequence are unbiased.
+class SobolSequence
+{
+public:
+    explicit SobolSequence(int dims);
+
+    // restart at the first point, XOR every coordinate with a new shift
+    void reset(boost::uint32_t seed);
+
+    // next point in (0, 1)^dims
+    void next(double *u);
+
+    int dims() const { return _dims; }
+
+    static const int MAX_DIMS = 8;
+    static const int BITS = 32;
+
+private:
+    int _dims;
+    boost::uint32_t _index;
+    boost::uint32_t _direction[MAX_DIMS][BITS];
+    boost::uint32_t _state[MAX_DIMS];
+    boost::uint32_t _shift[MAX_DIMS];
+};
+
+// inverse of the standard normal cdf, relative error below 1.2e-9 (Acklam)
+double normal_quantile(double p);
+
+#endif // SOBOL_H
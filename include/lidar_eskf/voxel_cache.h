@@ -0,0 +1,79 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#ifndef VOXEL_CACHE_H
+#define VOXEL_CACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <boost/cstdint.hpp>
+#include <boost/scoped_array.hpp>
+
+// Bounded open addressing table from voxel keys to log-likelihoods, shared
+// by all threads weighting one scan. Keys are the 48 bit octree key
+// (x | y << 16 | z << 32) tagged with a 15 bit scan epoch, so that slots of
+// earlier scans count as empty and new_scan() does not touch the table.
+// A slot is claimed with the BUSY bit set and only gets its plain tag once
+// the value is written. Lookups never block: a busy slot is a miss, and
+// inserts give up after MAX_PROBE slots.
+class VoxelCache
+{
+public:
+    explicit VoxelCache(int bits);
+
+    // start a new scan, not thread safe
+    void new_scan();
+
+    // true and the cached value if key is in the table
+    inline bool find(boost::uint64_t key, float &value) const {
+        if(key > KEY_MASK) return false;
+        boost::uint64_t tagged = key | _epoch;
+        size_t s = slot(key);
+        for(int p=0; p<MAX_PROBE; p++, s=(s+1)&_mask) {
+            boost::uint64_t k = _keys[s].load(std::memory_order_acquire);
+            if(k == tagged) {
+                value = _values[s].load(std::memory_order_relaxed);
+                return !std::isnan(value);
+            }
+            // still being written
+            if(k == (tagged | BUSY)) return false;
+            // keys are inserted at the first slot not used in this scan
+            if((k & EPOCH_MASK) != _epoch) return false;
+        }
+        return false;
+    }
+
+    void insert(boost::uint64_t key, float value);
+
+    size_t memory_usage() const { return (_mask + 1) * (sizeof(boost::uint64_t) + sizeof(float)); }
+
+    static const int MAX_PROBE = 8;
+    static const boost::uint64_t KEY_MASK = (boost::uint64_t(1) << 48) - 1;
+    // set while the value of a claimed slot is written
+    static const boost::uint64_t BUSY = KEY_MASK + 1;
+    static const boost::uint64_t EPOCH_MASK = ~(KEY_MASK | BUSY);
+    // key of points outside of the octree key range, never cached
+    static const boost::uint64_t NO_KEY = ~boost::uint64_t(0);
+
+private:
+    // lets the unit test put slots in states a race would leave them in
+    friend class VoxelCacheTest;
+
+    inline size_t slot(boost::uint64_t key) const {
+        return size_t((key * 0x9E3779B97F4A7C15ULL) >> _shift);
+    }
+
+    boost::scoped_array<std::atomic<boost::uint64_t> > _keys;
+    boost::scoped_array<std::atomic<float> > _values;
+    size_t _mask;
+    int _shift;
+    // current epoch in the top 15 bits, never 0
+    boost::uint64_t _epoch;
+};
+
+#endif // VOXEL_CACHE_H
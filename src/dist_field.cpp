@@ -0,0 +1,819 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include "lidar_eskf/dist_field.h"
+#include "lidar_eskf/edt.h"
+
+void DistField::get_dist(const float *x, const float *y, const float *z, int n,
+                         float *dist, char *mask) const {
+    for(int i=0; i<n; i++) {
+        octomap::point3d p(x[i], y[i], z[i]);
+        dist[i] = get_dist(p);
+        mask[i] = get_gridmask(p);
+    }
+}
+
+// truncated normal log-likelihood of the distances of a batched lookup
+static void distance_log_likelihood(const float *dist, const char *mask, int n,
+                                    double sigma, float *ll) {
+    const float c = -0.91893853320467274178 - log(sigma);
+    const float k = 0.5 / (sigma * sigma);
+    const float known_cap = 2.0 * sigma;
+    const float unknown_cap = 0.5 * sigma;
+
+    for(int i=0; i<n; i++) {
+        float cap = mask[i] != GRID_UNKNOWN ? known_cap : unknown_cap;
+        float d = (dist[i] >= 0.0f && dist[i] <= cap) ? dist[i] : cap;
+        ll[i] = c - k * d * d;
+    }
+}
+
+void DistField::get_log_likelihood(const float *x, const float *y, const float *z, int n,
+                                   double sigma, float *ll) const {
+    const int chunk = 256;
+    float dist[chunk];
+    char  mask[chunk];
+
+    for(int s=0; s<n; s+=chunk) {
+        int m = std::min(chunk, n - s);
+        get_dist(x + s, y + s, z + s, m, dist, mask);
+        distance_log_likelihood(dist, mask, m, sigma, ll + s);
+    }
+}
+
+void DistField::get_log_likelihood_keys(const int *kx, const int *ky, const int *kz, int n,
+                                        double sigma, float *ll) const {
+    const int chunk = 256;
+    float dist[chunk];
+    char  mask[chunk];
+
+    for(int s=0; s<n; s+=chunk) {
+        int m = std::min(chunk, n - s);
+        get_dist_keys(kx + s, ky + s, kz + s, m, dist, mask);
+        distance_log_likelihood(dist, mask, m, sigma, ll + s);
+    }
+}
+
+void DistField::get_dist_grad(const float *x, const float *y, const float *z, int n, float resolution,
+                              float *dist, float *gx, float *gy, float *gz) const {
+    const int chunk = 64;
+    float cx[8 * chunk], cy[8 * chunk], cz[8 * chunk], cd[8 * chunk];
+    float fx[chunk], fy[chunk], fz[chunk];
+    char  cm[8 * chunk];
+    const float inv_res = 1.0f / resolution;
+
+    for(int s=0; s<n; s+=chunk) {
+        int m = std::min(chunk, n - s);
+
+        // centers of the 8 voxels around each point, corner c of point i
+        // at c * m + i
+        for(int i=0; i<m; i++) {
+            float ux = x[s + i] * inv_res - 0.5f;
+            float uy = y[s + i] * inv_res - 0.5f;
+            float uz = z[s + i] * inv_res - 0.5f;
+            float bx = floor(ux), by = floor(uy), bz = floor(uz);
+            fx[i] = ux - bx;
+            fy[i] = uy - by;
+            fz[i] = uz - bz;
+            for(int c=0; c<8; c++) {
+                cx[c * m + i] = (bx + (c & 1) + 0.5f) * resolution;
+                cy[c * m + i] = (by + ((c >> 1) & 1) + 0.5f) * resolution;
+                cz[c * m + i] = (bz + ((c >> 2) & 1) + 0.5f) * resolution;
+            }
+        }
+        get_dist(cx, cy, cz, 8 * m, cd, cm);
+
+        for(int i=0; i<m; i++) {
+            const float d000 = cd[i],         d100 = cd[m + i];
+            const float d010 = cd[2 * m + i], d110 = cd[3 * m + i];
+            const float d001 = cd[4 * m + i], d101 = cd[5 * m + i];
+            const float d011 = cd[6 * m + i], d111 = cd[7 * m + i];
+            if(std::min(std::min(std::min(d000, d100), std::min(d010, d110)),
+                        std::min(std::min(d001, d101), std::min(d011, d111))) < 0.0f) {
+                dist[s + i] = -1.0f;
+                gx[s + i] = gy[s + i] = gz[s + i] = 0.0f;
+                continue;
+            }
+
+            const float u = fx[i], v = fy[i], w = fz[i];
+            // interpolate along x, then y, then z
+            float d00 = d000 + u * (d100 - d000), d10 = d010 + u * (d110 - d010);
+            float d01 = d001 + u * (d101 - d001), d11 = d011 + u * (d111 - d011);
+            float d0 = d00 + v * (d10 - d00), d1 = d01 + v * (d11 - d01);
+            dist[s + i] = d0 + w * (d1 - d0);
+
+            float ex0 = (d100 - d000) + v * ((d110 - d010) - (d100 - d000));
+            float ex1 = (d101 - d001) + v * ((d111 - d011) - (d101 - d001));
+            gx[s + i] = (ex0 + w * (ex1 - ex0)) * inv_res;
+            gy[s + i] = ((d10 - d00) + w * ((d11 - d01) - (d10 - d00))) * inv_res;
+            gz[s + i] = (d1 - d0) * inv_res;
+        }
+    }
+}
+
+void DistField::cast_rays(const octomap::point3d &origin,
+                          const float *dx, const float *dy, const float *dz, int n,
+                          float max_range, float resolution, float *range) const {
+    const int lanes = 64;
+    int   ray[lanes];
+    float t[lanes], vx[lanes], vy[lanes], vz[lanes];
+    float px[lanes], py[lanes], pz[lanes], dist[lanes];
+    char  mask[lanes];
+
+    // cell values are distances between cell centers, a point may be up to
+    // a cell closer to the obstacle surface than its cell says
+    const float margin = resolution;
+    const float min_step = 0.5f * resolution;
+    const float ox = origin.x(), oy = origin.y(), oz = origin.z();
+
+    // finished rays are replaced by new ones so that all lanes stay busy
+    int next = 0, active = 0;
+    while(true) {
+        while(active < lanes && next < n) {
+            ray[active] = next;
+            t[active] = 0.0f;
+            vx[active] = dx[next];
+            vy[active] = dy[next];
+            vz[active] = dz[next];
+            next++;
+            active++;
+        }
+        if(active == 0) break;
+
+        // directions are kept per lane so that this loop vectorizes
+        for(int i=0; i<active; i++) {
+            px[i] = ox + t[i] * vx[i];
+            py[i] = oy + t[i] * vy[i];
+            pz[i] = oz + t[i] * vz[i];
+        }
+        get_dist(px, py, pz, active, dist, mask);
+
+        for(int i=0; i<active; ) {
+            float step = std::max(dist[i] - margin, min_step);
+            bool hit = mask[i] == GRID_OCCUPIED;
+            bool miss = dist[i] < 0.0f || t[i] + step > max_range;
+            if(!hit && !miss) {
+                t[i] += step;
+                i++;
+                continue;
+            }
+            range[ray[i]] = hit ? t[i] : -1.0f;
+            active--;
+            ray[i] = ray[active];
+            t[i] = t[active];
+            vx[i] = vx[active];
+            vy[i] = vy[active];
+            vz[i] = vz[active];
+            dist[i] = dist[active];
+            mask[i] = mask[active];
+        }
+    }
+}
+
+DistField* create_dist_field(const std::string &type) {
+    if(type == "edt")   return new EDTField();
+    if(type == "dense") return new DenseField();
+    if(type == "block") return new BlockField();
+    if(type == "quant" || type == "quant8") return new QuantField<boost::uint8_t>();
+    if(type == "quant16") return new QuantField<boost::uint16_t>();
+    if(type == "lazy")  return new LazyField();
+    return NULL;
+}
+
+/* EDTField */
+
+void EDTField::build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                     const octomap::point3d &min,
+                     const octomap::point3d &max,
+                     double max_dist) {
+    _tree_ptr = tree_ptr;
+    _edt_ptr = boost::shared_ptr<DynamicEDTOctomap> (
+                 new DynamicEDTOctomap ( float ( max_dist ), _tree_ptr.get(), min, max, false ) );
+    _edt_ptr->update();
+
+    octomap::OcTreeKey min_key = _tree_ptr->coordToKey(min);
+    octomap::OcTreeKey max_key = _tree_ptr->coordToKey(max);
+    _num_cells = size_t(max_key[0] - min_key[0] + 1) *
+                 size_t(max_key[1] - min_key[1] + 1) *
+                 size_t(max_key[2] - min_key[2] + 1);
+}
+
+void EDTField::update() {
+    _edt_ptr->update();
+}
+
+double EDTField::get_dist(const octomap::point3d &p) const {
+    return _edt_ptr->getDistance(p);
+}
+
+void EDTField::get_dist_keys(const int *kx, const int *ky, const int *kz, int n,
+                             float *dist, char *mask) const {
+    for(int i=0; i<n; i++) {
+        octomap::OcTreeKey key(kx[i], ky[i], kz[i]);
+        dist[i] = _edt_ptr->getDistance(_tree_ptr->keyToCoord(key));
+        octomap::OcTreeNode* node = _tree_ptr->search(key);
+        mask[i] = !node ? GRID_UNKNOWN : _tree_ptr->isNodeOccupied(node) ? GRID_OCCUPIED : GRID_FREE;
+    }
+}
+
+char EDTField::get_gridmask(const octomap::point3d &p) const {
+    octomap::OcTreeKey key = _tree_ptr->coordToKey(p);
+    octomap::OcTreeNode* node = _tree_ptr->search(key);
+    if(!node) {
+        return GRID_UNKNOWN;
+    } else if(_tree_ptr->isNodeOccupied(node)) {
+        return GRID_OCCUPIED;
+    } else {
+        return GRID_FREE;
+    }
+}
+
+size_t EDTField::memory_usage() const {
+    // DynamicEDT3D keeps a dataCell (float, 5 ints, char) and a bool per cell
+    return _num_cells * (sizeof(float) + 5 * sizeof(int) + sizeof(char) + sizeof(bool));
+}
+
+/* GridField */
+
+void GridField::build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                      const octomap::point3d &min,
+                      const octomap::point3d &max,
+                      double max_dist) {
+    init_geometry(tree_ptr, min, max, max_dist);
+
+    std::vector<float> dist;
+    std::vector<char> mask;
+    compute_region(0, 0, 0, _size_x, _size_y, _size_z, dist, mask);
+    store(dist, mask);
+}
+
+void GridField::init_geometry(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                              const octomap::point3d &min,
+                              const octomap::point3d &max,
+                              double max_dist) {
+    _tree_ptr = tree_ptr;
+    _min = min;
+    _max = max;
+    _max_dist = max_dist;
+    _resolution = _tree_ptr->getResolution();
+    _inv_resolution = 1.0 / _resolution;
+
+    _min_key = _tree_ptr->coordToKey(min);
+    octomap::OcTreeKey max_key = _tree_ptr->coordToKey(max);
+    _size_x = max_key[0] - _min_key[0] + 1;
+    _size_y = max_key[1] - _min_key[1] + 1;
+    _size_z = max_key[2] - _min_key[2] + 1;
+    _bricks_x = (_size_x + 7) >> 3;
+    _bricks_y = (_size_y + 7) >> 3;
+    _bricks_z = (_size_z + 7) >> 3;
+
+    // saturation as in DynamicEDT3D
+    _max_sq_dist = int(float(max_dist) / _resolution * float(max_dist) / _resolution);
+}
+
+void GridField::compute_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                               std::vector<float> &dist, std::vector<char> &mask) const {
+    // obstacles further than the saturation distance do not matter
+    int pad = int(sqrt(double(_max_sq_dist))) + 1;
+    int px0 = std::max(x0 - pad, 0), px1 = std::min(x1 + pad, _size_x);
+    int py0 = std::max(y0 - pad, 0), py1 = std::min(y1 + pad, _size_y);
+    int pz0 = std::max(z0 - pad, 0), pz1 = std::min(z1 + pad, _size_z);
+    int nx = px1 - px0, ny = py1 - py0, nz = pz1 - pz0;
+    size_t num_cells = size_t(nx) * ny * nz;
+
+    // masks from the octree leafs, cells not covered by any leaf are unknown
+    std::vector<char> pmask(num_cells, GRID_UNKNOWN);
+    octomap::OcTreeKey bbx_min(_min_key[0] + px0, _min_key[1] + py0, _min_key[2] + pz0);
+    octomap::OcTreeKey bbx_max(_min_key[0] + px1 - 1, _min_key[1] + py1 - 1, _min_key[2] + pz1 - 1);
+    unsigned int tree_depth = _tree_ptr->getTreeDepth();
+    for(octomap::OcTree::leaf_bbx_iterator it = _tree_ptr->begin_leafs_bbx(bbx_min, bbx_max),
+        end = _tree_ptr->end_leafs_bbx(); it != end; ++it) {
+        char value = _tree_ptr->isNodeOccupied(*it) ? GRID_OCCUPIED : GRID_FREE;
+        octomap::OcTreeKey key = it.getIndexKey();
+        int span = 1 << (tree_depth - it.getDepth());
+        int cx = int(key[0]) - int(bbx_min[0]);
+        int cy = int(key[1]) - int(bbx_min[1]);
+        int cz = int(key[2]) - int(bbx_min[2]);
+        for(int iz=std::max(cz, 0); iz<std::min(cz + span, nz); iz++) {
+            for(int iy=std::max(cy, 0); iy<std::min(cy + span, ny); iy++) {
+                for(int ix=std::max(cx, 0); ix<std::min(cx + span, nx); ix++) {
+                    pmask[(size_t(iz) * ny + iy) * nx + ix] = value;
+                }
+            }
+        }
+    }
+
+    // exact distances from the parallel EDT, saturated like DynamicEDT3D
+    std::vector<char> occupied(num_cells);
+    for(size_t i=0; i<num_cells; i++) {
+        occupied[i] = pmask[i] == GRID_OCCUPIED;
+    }
+    std::vector<float> pdist;
+    squared_edt(occupied, nx, ny, nz, _max_sq_dist, pdist);
+
+    float sat_dist = float(sqrt(double(_max_sq_dist))) * _resolution;
+#pragma omp parallel for
+    for(long i=0; i<long(num_cells); i++) {
+        pdist[i] = pdist[i] <= _max_sq_dist ? float(sqrt(double(pdist[i]))) * _resolution : sat_dist;
+    }
+
+    if(px0 == x0 && py0 == y0 && pz0 == z0 && px1 == x1 && py1 == y1 && pz1 == z1) {
+        dist.swap(pdist);
+        mask.swap(pmask);
+        return;
+    }
+
+    // cut the padding
+    int bx = x1 - x0, by = y1 - y0, bz = z1 - z0;
+    dist.resize(size_t(bx) * by * bz);
+    mask.resize(size_t(bx) * by * bz);
+    for(int iz=0; iz<bz; iz++) {
+        for(int iy=0; iy<by; iy++) {
+            size_t src = (size_t(iz + z0 - pz0) * ny + (iy + y0 - py0)) * nx + (x0 - px0);
+            size_t dst = (size_t(iz) * by + iy) * bx;
+            std::copy(pdist.begin() + src, pdist.begin() + src + bx, dist.begin() + dst);
+            std::copy(pmask.begin() + src, pmask.begin() + src + bx, mask.begin() + dst);
+        }
+    }
+}
+
+void GridField::update() {
+    build(_tree_ptr, _min, _max, _max_dist);
+}
+
+bool GridField::region_cells(const octomap::point3d &min, const octomap::point3d &max,
+                             int &x0, int &y0, int &z0, int &x1, int &y1, int &z1) const {
+    // distances change up to the saturation distance away from the change
+    int pad = int(sqrt(double(_max_sq_dist))) + 1;
+    cell_index(min.x(), min.y(), min.z(), x0, y0, z0);
+    cell_index(max.x(), max.y(), max.z(), x1, y1, z1);
+    x0 = std::max(x0 - pad, 0); x1 = std::min(x1 + pad + 1, _size_x);
+    y0 = std::max(y0 - pad, 0); y1 = std::min(y1 + pad + 1, _size_y);
+    z0 = std::max(z0 - pad, 0); z1 = std::min(z1 + pad + 1, _size_z);
+    return x0 < x1 && y0 < y1 && z0 < z1;
+}
+
+void GridField::update_region(const octomap::point3d &min, const octomap::point3d &max) {
+    int x0, y0, z0, x1, y1, z1;
+    if(!region_cells(min, max, x0, y0, z0, x1, y1, z1)) {
+        return;
+    }
+    std::vector<float> dist;
+    std::vector<char> mask;
+    compute_region(x0, y0, z0, x1, y1, z1, dist, mask);
+    store_region(x0, y0, z0, x1, y1, z1, dist, mask);
+}
+
+double GridField::get_dist(const octomap::point3d &p) const {
+    int ix, iy, iz;
+    if(!cell_index(p.x(), p.y(), p.z(), ix, iy, iz)) {
+        return -1.0;
+    }
+    return cell_dist(ix, iy, iz);
+}
+
+char GridField::get_gridmask(const octomap::point3d &p) const {
+    int ix, iy, iz;
+    if(!cell_index(p.x(), p.y(), p.z(), ix, iy, iz)) {
+        return GRID_UNKNOWN;
+    }
+    return cell_mask(ix, iy, iz);
+}
+
+void GridField::get_dist(const float *x, const float *y, const float *z, int n,
+                         float *dist, char *mask) const {
+    int ix[BATCH_SIZE], iy[BATCH_SIZE], iz[BATCH_SIZE];
+    const double inv_res = _inv_resolution;
+    const int ox = 32768 - _min_key[0];
+    const int oy = 32768 - _min_key[1];
+    const int oz = 32768 - _min_key[2];
+
+    for(int s=0; s<n; s+=BATCH_SIZE) {
+        int m = std::min(int(BATCH_SIZE), n - s);
+
+        // branch free floor() so that the key computation vectorizes
+        for(int i=0; i<m; i++) {
+            double fx = x[s + i] * inv_res;
+            double fy = y[s + i] * inv_res;
+            double fz = z[s + i] * inv_res;
+            int kx = int(fx), ky = int(fy), kz = int(fz);
+            ix[i] = kx - (fx < kx) + ox;
+            iy[i] = ky - (fy < ky) + oy;
+            iz[i] = kz - (fz < kz) + oz;
+        }
+        gather(ix, iy, iz, m, dist + s, mask + s);
+    }
+}
+
+void GridField::get_dist_keys(const int *kx, const int *ky, const int *kz, int n,
+                              float *dist, char *mask) const {
+    int ix[BATCH_SIZE], iy[BATCH_SIZE], iz[BATCH_SIZE];
+    const int ox = _min_key[0], oy = _min_key[1], oz = _min_key[2];
+
+    for(int s=0; s<n; s+=BATCH_SIZE) {
+        int m = std::min(int(BATCH_SIZE), n - s);
+        for(int i=0; i<m; i++) {
+            ix[i] = kx[s + i] - ox;
+            iy[i] = ky[s + i] - oy;
+            iz[i] = kz[s + i] - oz;
+        }
+        gather(ix, iy, iz, m, dist + s, mask + s);
+    }
+}
+
+/* DenseField */
+
+void DenseField::gather(const int *ix, const int *iy, const int *iz, int n,
+                        float *dist, char *mask) const {
+    size_t idx[BATCH_SIZE];
+    bool valid[BATCH_SIZE];
+
+    // resolve and prefetch all cells first, then read them
+    for(int i=0; i<n; i++) {
+        valid[i] = in_grid(ix[i], iy[i], iz[i]);
+        idx[i] = valid[i] ? storage_index(ix[i], iy[i], iz[i]) : 0;
+        __builtin_prefetch(&_dist[idx[i]]);
+        __builtin_prefetch(&_mask[idx[i]]);
+    }
+    for(int i=0; i<n; i++) {
+        dist[i] = valid[i] ? _dist[idx[i]] : -1.0f;
+        mask[i] = valid[i] ? _mask[idx[i]] : char(GRID_UNKNOWN);
+    }
+}
+
+void DenseField::store(const std::vector<float> &dist, const std::vector<char> &mask) {
+    if(_layout == LAYOUT_LINEAR) {
+        _dist = dist;
+        _mask = mask;
+        return;
+    }
+
+    // padding cells of partial bricks are never read
+    _dist.assign(storage_size(), 0.0f);
+    _mask.assign(storage_size(), GRID_UNKNOWN);
+    for(int iz=0; iz<_size_z; iz++) {
+        for(int iy=0; iy<_size_y; iy++) {
+            for(int ix=0; ix<_size_x; ix++) {
+                size_t i = storage_index(ix, iy, iz);
+                _dist[i] = dist[linear_index(ix, iy, iz)];
+                _mask[i] = mask[linear_index(ix, iy, iz)];
+            }
+        }
+    }
+}
+
+void DenseField::store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                              const std::vector<float> &dist, const std::vector<char> &mask) {
+    size_t i = 0;
+    for(int iz=z0; iz<z1; iz++) {
+        for(int iy=y0; iy<y1; iy++) {
+            for(int ix=x0; ix<x1; ix++, i++) {
+                _dist[storage_index(ix, iy, iz)] = dist[i];
+                _mask[storage_index(ix, iy, iz)] = mask[i];
+            }
+        }
+    }
+}
+
+size_t DenseField::memory_usage() const {
+    return _dist.size() * sizeof(float) + _mask.size() * sizeof(char);
+}
+
+/* BlockField */
+
+void BlockField::store(const std::vector<float> &dist, const std::vector<char> &mask) {
+    _blocks_x = (_size_x + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    _blocks_y = (_size_y + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    _blocks_z = (_size_z + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    size_t num_blocks = size_t(_blocks_x) * _blocks_y * _blocks_z;
+
+    // saturated distance as produced by the EDT
+    _sat_dist = dist.empty() ? float(_max_dist) : *std::max_element(dist.begin(), dist.end());
+
+    _table.assign(num_blocks, -1);
+    _table_mask.assign(num_blocks, GRID_UNKNOWN);
+    _blocks.clear();
+
+    for(int bz=0; bz<_blocks_z; bz++) {
+        for(int by=0; by<_blocks_y; by++) {
+            for(int bx=0; bx<_blocks_x; bx++) {
+                size_t b = (size_t(bz) * _blocks_y + by) * _blocks_x + bx;
+
+                // a block is kept if any cell is close to an obstacle or
+                // the masks are mixed; cells beyond the grid are padding
+                bool uniform = true;
+                char first_mask = mask[linear_index(bx << BLOCK_BITS, by << BLOCK_BITS, bz << BLOCK_BITS)];
+                for(int iz=bz<<BLOCK_BITS; uniform && iz<std::min((bz+1)<<BLOCK_BITS, _size_z); iz++) {
+                    for(int iy=by<<BLOCK_BITS; uniform && iy<std::min((by+1)<<BLOCK_BITS, _size_y); iy++) {
+                        for(int ix=bx<<BLOCK_BITS; ix<std::min((bx+1)<<BLOCK_BITS, _size_x); ix++) {
+                            size_t idx = linear_index(ix, iy, iz);
+                            if(mask[idx] != first_mask || dist[idx] < _sat_dist) {
+                                uniform = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+
+                if(uniform) {
+                    _table_mask[b] = first_mask;
+                    continue;
+                }
+
+                _table[b] = _blocks.size();
+                _blocks.push_back(Block());
+                Block &block = _blocks.back();
+                std::fill(block.dist, block.dist + BLOCK_CELLS, _sat_dist);
+                std::fill(block.mask, block.mask + BLOCK_CELLS, char(GRID_UNKNOWN));
+                for(int iz=bz<<BLOCK_BITS; iz<std::min((bz+1)<<BLOCK_BITS, _size_z); iz++) {
+                    for(int iy=by<<BLOCK_BITS; iy<std::min((by+1)<<BLOCK_BITS, _size_y); iy++) {
+                        for(int ix=bx<<BLOCK_BITS; ix<std::min((bx+1)<<BLOCK_BITS, _size_x); ix++) {
+                            size_t idx = linear_index(ix, iy, iz);
+                            block.dist[cell_offset(ix, iy, iz)] = dist[idx];
+                            block.mask[cell_offset(ix, iy, iz)] = mask[idx];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void BlockField::store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                              const std::vector<float> &dist, const std::vector<char> &mask) {
+    size_t i = 0;
+    for(int iz=z0; iz<z1; iz++) {
+        for(int iy=y0; iy<y1; iy++) {
+            for(int ix=x0; ix<x1; ix++, i++) {
+                size_t b = block_index(ix, iy, iz);
+                if(_table[b] < 0) {
+                    // blocks are not released again when they turn uniform
+                    if(dist[i] >= _sat_dist && mask[i] == _table_mask[b]) {
+                        continue;
+                    }
+                    _table[b] = _blocks.size();
+                    _blocks.push_back(Block());
+                    Block &block = _blocks.back();
+                    std::fill(block.dist, block.dist + BLOCK_CELLS, _sat_dist);
+                    std::fill(block.mask, block.mask + BLOCK_CELLS, _table_mask[b]);
+                }
+                Block &block = _blocks[_table[b]];
+                block.dist[cell_offset(ix, iy, iz)] = dist[i];
+                block.mask[cell_offset(ix, iy, iz)] = mask[i];
+            }
+        }
+    }
+}
+
+float BlockField::cell_dist(int ix, int iy, int iz) const {
+    boost::int32_t b = _table[block_index(ix, iy, iz)];
+    if(b < 0) {
+        return _sat_dist;
+    }
+    return _blocks[b].dist[cell_offset(ix, iy, iz)];
+}
+
+char BlockField::cell_mask(int ix, int iy, int iz) const {
+    size_t bi = block_index(ix, iy, iz);
+    boost::int32_t b = _table[bi];
+    if(b < 0) {
+        return _table_mask[bi];
+    }
+    return _blocks[b].mask[cell_offset(ix, iy, iz)];
+}
+
+void BlockField::gather(const int *ix, const int *iy, const int *iz, int n,
+                        float *dist, char *mask) const {
+    size_t bidx[BATCH_SIZE];
+    bool valid[BATCH_SIZE];
+    boost::int32_t b[BATCH_SIZE];
+    int off[BATCH_SIZE];
+
+    for(int i=0; i<n; i++) {
+        valid[i] = in_grid(ix[i], iy[i], iz[i]);
+        bidx[i] = valid[i] ? block_index(ix[i], iy[i], iz[i]) : 0;
+        off[i] = cell_offset(ix[i], iy[i], iz[i]);
+        __builtin_prefetch(&_table[bidx[i]]);
+    }
+    for(int i=0; i<n; i++) {
+        b[i] = _table[bidx[i]];
+        if(b[i] >= 0) {
+            __builtin_prefetch(&_blocks[b[i]].dist[off[i]]);
+            __builtin_prefetch(&_blocks[b[i]].mask[off[i]]);
+        }
+    }
+    for(int i=0; i<n; i++) {
+        if(!valid[i]) {
+            dist[i] = -1.0f;
+            mask[i] = GRID_UNKNOWN;
+        } else if(b[i] < 0) {
+            dist[i] = _sat_dist;
+            mask[i] = _table_mask[bidx[i]];
+        } else {
+            dist[i] = _blocks[b[i]].dist[off[i]];
+            mask[i] = _blocks[b[i]].mask[off[i]];
+        }
+    }
+}
+
+size_t BlockField::memory_usage() const {
+    return _table.size() * (sizeof(boost::int32_t) + sizeof(char)) +
+           _blocks.size() * sizeof(Block);
+}
+
+/* QuantField */
+
+template <typename T>
+void QuantField<T>::store(const std::vector<float> &dist, const std::vector<char> &mask) {
+    _scale = _max_dist / DIST_MASK;
+    _cells.assign(storage_size(), T(GRID_UNKNOWN) << MASK_SHIFT);
+    for(int iz=0; iz<_size_z; iz++) {
+        for(int iy=0; iy<_size_y; iy++) {
+            for(int ix=0; ix<_size_x; ix++) {
+                size_t i = linear_index(ix, iy, iz);
+                float d = std::min(std::max(dist[i], 0.0f), float(_max_dist));
+                _cells[storage_index(ix, iy, iz)] = (T(mask[i]) << MASK_SHIFT) | T(d / _scale + 0.5f);
+            }
+        }
+    }
+}
+
+template <typename T>
+void QuantField<T>::store_region(int x0, int y0, int z0, int x1, int y1, int z1,
+                                 const std::vector<float> &dist, const std::vector<char> &mask) {
+    size_t i = 0;
+    for(int iz=z0; iz<z1; iz++) {
+        for(int iy=y0; iy<y1; iy++) {
+            for(int ix=x0; ix<x1; ix++, i++) {
+                float d = std::min(std::max(dist[i], 0.0f), float(_max_dist));
+                _cells[storage_index(ix, iy, iz)] = (T(mask[i]) << MASK_SHIFT) | T(d / _scale + 0.5f);
+            }
+        }
+    }
+}
+
+template <typename T>
+void QuantField<T>::gather(const int *ix, const int *iy, const int *iz, int n,
+                           float *dist, char *mask) const {
+    size_t idx[BATCH_SIZE];
+    bool valid[BATCH_SIZE];
+
+    for(int i=0; i<n; i++) {
+        valid[i] = in_grid(ix[i], iy[i], iz[i]);
+        idx[i] = valid[i] ? storage_index(ix[i], iy[i], iz[i]) : 0;
+        __builtin_prefetch(&_cells[idx[i]]);
+    }
+    for(int i=0; i<n; i++) {
+        T c = _cells[idx[i]];
+        dist[i] = valid[i] ? (c & DIST_MASK) * _scale : -1.0f;
+        mask[i] = valid[i] ? char(c >> MASK_SHIFT) : char(GRID_UNKNOWN);
+    }
+}
+
+template <typename T>
+size_t QuantField<T>::memory_usage() const {
+    return _cells.size() * sizeof(T);
+}
+
+template class QuantField<boost::uint8_t>;
+template class QuantField<boost::uint16_t>;
+
+/* LazyField */
+
+void LazyField::build(boost::shared_ptr<octomap::OcTree> tree_ptr,
+                      const octomap::point3d &min,
+                      const octomap::point3d &max,
+                      double max_dist) {
+    clear();
+    init_geometry(tree_ptr, min, max, max_dist);
+
+    _blocks_x = (_size_x + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    _blocks_y = (_size_y + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    _blocks_z = (_size_z + BLOCK_SIZE - 1) >> BLOCK_BITS;
+    _num_blocks = size_t(_blocks_x) * _blocks_y * _blocks_z;
+    _table.reset(new std::atomic<Block*>[_num_blocks]);
+    for(size_t b=0; b<_num_blocks; b++) {
+        _table[b].store(NULL);
+    }
+}
+
+void LazyField::update() {
+    for(size_t b=0; b<_num_blocks; b++) {
+        delete _table[b].exchange(NULL);
+    }
+    _num_computed = 0;
+}
+
+void LazyField::update_region(const octomap::point3d &min, const octomap::point3d &max) {
+    int x0, y0, z0, x1, y1, z1;
+    if(!region_cells(min, max, x0, y0, z0, x1, y1, z1)) {
+        return;
+    }
+    for(int bz=z0>>BLOCK_BITS; bz<=(z1-1)>>BLOCK_BITS; bz++) {
+        for(int by=y0>>BLOCK_BITS; by<=(y1-1)>>BLOCK_BITS; by++) {
+            for(int bx=x0>>BLOCK_BITS; bx<=(x1-1)>>BLOCK_BITS; bx++) {
+                size_t b = (size_t(bz) * _blocks_y + by) * _blocks_x + bx;
+                Block *block = _table[b].exchange(NULL);
+                if(block) {
+                    delete block;
+                    _num_computed--;
+                }
+            }
+        }
+    }
+}
+
+void LazyField::clear() {
+    update();
+    _table.reset();
+    _num_blocks = 0;
+}
+
+const LazyField::Block* LazyField::get_block(int ix, int iy, int iz) const {
+    int bx = ix >> BLOCK_BITS, by = iy >> BLOCK_BITS, bz = iz >> BLOCK_BITS;
+    size_t b = (size_t(bz) * _blocks_y + by) * _blocks_x + bx;
+    Block *block = _table[b].load(std::memory_order_acquire);
+    if(block) {
+        return block;
+    }
+
+    // compute outside of any lock, the first thread to finish publishes
+    int x0 = bx << BLOCK_BITS, y0 = by << BLOCK_BITS, z0 = bz << BLOCK_BITS;
+    int x1 = std::min(x0 + BLOCK_SIZE, _size_x);
+    int y1 = std::min(y0 + BLOCK_SIZE, _size_y);
+    int z1 = std::min(z0 + BLOCK_SIZE, _size_z);
+    std::vector<float> dist;
+    std::vector<char> mask;
+    compute_region(x0, y0, z0, x1, y1, z1, dist, mask);
+
+    Block *fresh = new Block;
+    std::fill(fresh->dist, fresh->dist + BLOCK_CELLS, 0.0f);
+    std::fill(fresh->mask, fresh->mask + BLOCK_CELLS, char(GRID_UNKNOWN));
+    for(int iz=z0; iz<z1; iz++) {
+        for(int iy=y0; iy<y1; iy++) {
+            for(int ix=x0; ix<x1; ix++) {
+                size_t i = (size_t(iz - z0) * (y1 - y0) + (iy - y0)) * (x1 - x0) + (ix - x0);
+                fresh->dist[cell_offset(ix, iy, iz)] = dist[i];
+                fresh->mask[cell_offset(ix, iy, iz)] = mask[i];
+            }
+        }
+    }
+
+    Block *expected = NULL;
+    if(_table[b].compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+        _num_computed++;
+        return fresh;
+    }
+    delete fresh;
+    return expected;
+}
+
+void LazyField::warm_up(const octomap::point3d &center, double radius) {
+    int ix0, iy0, iz0, ix1, iy1, iz1;
+    cell_index(center.x() - radius, center.y() - radius, center.z() - radius, ix0, iy0, iz0);
+    cell_index(center.x() + radius, center.y() + radius, center.z() + radius, ix1, iy1, iz1);
+    int bx0 = std::max(ix0, 0) >> BLOCK_BITS, bx1 = std::min(ix1, _size_x - 1) >> BLOCK_BITS;
+    int by0 = std::max(iy0, 0) >> BLOCK_BITS, by1 = std::min(iy1, _size_y - 1) >> BLOCK_BITS;
+    int bz0 = std::max(iz0, 0) >> BLOCK_BITS, bz1 = std::min(iz1, _size_z - 1) >> BLOCK_BITS;
+    if(bx0 > bx1 || by0 > by1 || bz0 > bz1) {
+        return;
+    }
+
+    int nx = bx1 - bx0 + 1, ny = by1 - by0 + 1, nz = bz1 - bz0 + 1;
+#pragma omp parallel for schedule(dynamic)
+    for(int i=0; i<nx*ny*nz; i++) {
+        int bx = bx0 + i % nx, by = by0 + (i / nx) % ny, bz = bz0 + i / (nx * ny);
+        get_block(bx << BLOCK_BITS, by << BLOCK_BITS, bz << BLOCK_BITS);
+    }
+}
+
+float LazyField::cell_dist(int ix, int iy, int iz) const {
+    return get_block(ix, iy, iz)->dist[cell_offset(ix, iy, iz)];
+}
+
+char LazyField::cell_mask(int ix, int iy, int iz) const {
+    return get_block(ix, iy, iz)->mask[cell_offset(ix, iy, iz)];
+}
+
+void LazyField::gather(const int *ix, const int *iy, const int *iz, int n,
+                       float *dist, char *mask) const {
+    for(int i=0; i<n; i++) {
+        if(!in_grid(ix[i], iy[i], iz[i])) {
+            dist[i] = -1.0f;
+            mask[i] = GRID_UNKNOWN;
+            continue;
+        }
+        const Block *block = get_block(ix[i], iy[i], iz[i]);
+        int off = cell_offset(ix[i], iy[i], iz[i]);
+        dist[i] = block->dist[off];
+        mask[i] = block->mask[off];
+    }
+}
+
+size_t LazyField::memory_usage() const {
+    return _num_blocks * sizeof(std::atomic<Block*>) + _num_computed * sizeof(Block);
+}
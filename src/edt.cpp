@@ -0,0 +1,99 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include "lidar_eskf/edt.h"
+#include <algorithm>
+#include <limits>
+
+static const float INF = std::numeric_limits<float>::infinity();
+
+// 1D squared distance transform of f (n samples, stride between samples)
+// into d, using the lower envelope of parabolas rooted at the finite
+// samples. Values above band are set to inf.
+static void edt_1d(const float *f, int n, size_t stride, float band,
+                   float *d, int *v, float *z) {
+    int k = -1;
+    for(int q=0; q<n; q++) {
+        float fq = f[q * stride];
+        if(fq == INF) continue;
+        float s = -INF;
+        while(k >= 0) {
+            int p = v[k];
+            s = ((fq + float(q) * q) - (f[p * stride] + float(p) * p)) / (2.0f * (q - p));
+            if(s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = k == 0 ? -INF : s;
+        z[k + 1] = INF;
+    }
+
+    if(k < 0) {
+        for(int q=0; q<n; q++) d[q] = INF;
+        return;
+    }
+
+    k = 0;
+    for(int q=0; q<n; q++) {
+        while(z[k + 1] < q) k++;
+        float dq = float(q - v[k]) * (q - v[k]) + f[v[k] * stride];
+        d[q] = dq <= band ? dq : INF;
+    }
+}
+
+void squared_edt(const std::vector<char> &occupied,
+                 int size_x, int size_y, int size_z,
+                 float max_sq_dist,
+                 std::vector<float> &sq_dist) {
+    const size_t sx = size_x;
+    const size_t sxy = size_t(size_x) * size_y;
+    const int max_size = std::max(size_x, std::max(size_y, size_z));
+
+    sq_dist.resize(sxy * size_z);
+    for(size_t i=0; i<occupied.size(); i++) {
+        sq_dist[i] = occupied[i] ? 0.0f : INF;
+    }
+
+    // each pass only adds non negative terms, so values beyond the band
+    // can be dropped early without changing the result inside of it
+#pragma omp parallel
+    {
+        std::vector<float> d(max_size), z(max_size + 1);
+        std::vector<int> v(max_size);
+
+        // x pass: rows are contiguous
+#pragma omp for
+        for(int iz=0; iz<size_z; iz++) {
+            for(int iy=0; iy<size_y; iy++) {
+                float *row = &sq_dist[iz * sxy + iy * sx];
+                edt_1d(row, size_x, 1, max_sq_dist, &d[0], &v[0], &z[0]);
+                std::copy(d.begin(), d.begin() + size_x, row);
+            }
+        }
+
+        // y pass: one z slab per iteration
+#pragma omp for
+        for(int iz=0; iz<size_z; iz++) {
+            for(int ix=0; ix<size_x; ix++) {
+                float *col = &sq_dist[iz * sxy + ix];
+                edt_1d(col, size_y, size_x, max_sq_dist, &d[0], &v[0], &z[0]);
+                for(int iy=0; iy<size_y; iy++) col[iy * sx] = d[iy];
+            }
+        }
+
+        // z pass: one y slab per iteration
+#pragma omp for
+        for(int iy=0; iy<size_y; iy++) {
+            for(int ix=0; ix<size_x; ix++) {
+                float *col = &sq_dist[iy * sx + ix];
+                edt_1d(col, size_z, sxy, max_sq_dist, &d[0], &v[0], &z[0]);
+                for(int iz=0; iz<size_z; iz++) col[iz * sxy] = d[iz];
+            }
+        }
+    }
+}
@@ -17,6 +17,10 @@ Eigen::Matrix3d skew(Eigen::Vector3d w) {
 
 Eigen::Matrix3d angle_axis_to_rotation_matrix(Eigen::Vector3d w) {
     double theta = w.norm();
+    // w / theta is undefined at zero, first order below
+    if(theta < 1e-10) {
+        return Eigen::Matrix3d::Identity() + skew(w);
+    }
     Eigen::Matrix3d  W;
     Eigen::Matrix3d  I;
     Eigen::Matrix3d  R;
@@ -34,6 +38,49 @@ Eigen::Matrix3d euler_angle_to_rotation_matrix(Eigen::Vector3d w) {
     return R;
 }
 
+// selects the position and theta from the error state
+static Eigen::Matrix<double, 6, 15> pose_jacobian() {
+    Eigen::Matrix<double, 6, 15> H;
+    Eigen::Matrix3d I = Eigen::Matrix3d::Identity();
+    Eigen::Matrix3d Z = Eigen::Matrix3d::Zero();
+    H << Z, I, Z, Z, Z,
+         Z, Z, I, Z, Z;
+    return H;
+}
+
+// measurement y = C x + n with innovation covariance S
+static Eigen::Matrix<double, 15, 1> kalman_update(const Eigen::Matrix<double, 6, 1> &y,
+                                                  const Eigen::Matrix<double, 6, 15> &C,
+                                                  const Eigen::Matrix<double, 6, 6> &S,
+                                                  Eigen::Matrix<double, 15, 15> &Sigma) {
+    // kalman gain matrix, K = Sigma C^T S^-1 from a factorization of S
+    Eigen::Matrix<double, 15, 6> K;
+    K = S.ldlt().solve(C * Sigma).transpose();
+
+    // update covariance
+    Sigma -= K * (C * Sigma);
+    Sigma = 0.5 * (Sigma + Sigma.transpose());
+
+    return K * y;
+}
+
+Eigen::Matrix<double, 15, 1> update_pose_cov(const Eigen::Matrix<double, 6, 1> &y,
+                                             const Eigen::Matrix<double, 6, 6> &R,
+                                             Eigen::Matrix<double, 15, 15> &Sigma) {
+    Eigen::Matrix<double, 6, 15> H = pose_jacobian();
+    Eigen::Matrix<double, 6, 6> S = H * Sigma * H.transpose() + R;
+    return kalman_update(y, H, S, Sigma);
+}
+
+Eigen::Matrix<double, 15, 1> update_pose_info(const Eigen::Matrix<double, 6, 6> &W,
+                                              const Eigen::Matrix<double, 6, 1> &z,
+                                              Eigen::Matrix<double, 15, 15> &Sigma) {
+    // whitened measurement, unit noise
+    Eigen::Matrix<double, 6, 15> C = W.transpose() * pose_jacobian();
+    Eigen::Matrix<double, 6, 6> S = Eigen::Matrix<double, 6, 6>::Identity() + C * Sigma * C.transpose();
+    return kalman_update(z, C, S, Sigma);
+}
+
 ESKF::ESKF(ros::NodeHandle &nh) {
 
     
@@ -60,6 +107,9 @@ ESKF::ESKF(ros::NodeHandle &nh) {
     nh.param("init_bias_acc_z",         _init_bias_acc_z,  0.0);
     nh.param("acc_queue_size",          _acc_queue_size,   5);
     nh.param("imu_transform",           _imu_transform,    false);
+    int pose_history_size;
+    nh.param("pose_history_size",       pose_history_size, 500);
+    _pose_history.set_capacity(std::max(pose_history_size, 2));
 
     // initialize nomial states
     _velocity.setZero();
@@ -89,6 +139,10 @@ ESKF::ESKF(ros::NodeHandle &nh) {
     _m_position.setZero();
     _m_theta.setZero();
     _got_measurements = false;
+    _m_info_form = false;
+    _m_pose_sigma.setIdentity();
+    _m_info_sqrt.setZero();
+    _m_info_z.setZero();
 
     // initialize Jacobian matrix;
     _Fx.setZero();
@@ -102,6 +156,8 @@ ESKF::ESKF(ros::NodeHandle &nh) {
     _gravity << 0.0,0.0,_g;
     // time relatives
     _init_time = true;
+    _start_time = ros::WallTime::now();
+    _first_odom = true;
 
     // subscriber and publisher
     _imu_sub  = nh.subscribe("/imu", 50, &ESKF::imu_callback, this);
@@ -143,6 +199,12 @@ void ESKF::imu_callback(const sensor_msgs::Imu &msg) {
         _got_measurements = false;
     }
 
+    PoseSample sample;
+    sample.time = msg.header.stamp;
+    sample.position = _position;
+    sample.rotation = _quaternion;
+    _pose_history.push_back(sample);
+
     publish_odom();
 }
 
@@ -305,6 +367,40 @@ void ESKF::get_cov_pose(Eigen::Matrix<double, 6, 6> &cov_pose) {
     cov_pose = _Sigma.block<6,6>(3,3);
 }
 
+void ESKF::get_velocity(Eigen::Vector3d &velocity) {
+    velocity = _velocity;
+}
+
+static bool pose_sample_before(const ros::Time &t, const PoseSample &sample) {
+    return t < sample.time;
+}
+
+bool ESKF::get_pose_at(const ros::Time &t, Eigen::Matrix<double, 7, 1> &pose) {
+    if(_pose_history.empty() || t < _pose_history.front().time) return false;
+
+    Eigen::Vector3d position = _pose_history.back().position;
+    Eigen::Quaterniond rotation = _pose_history.back().rotation;
+    if(t < _pose_history.back().time) {
+        // first sample after t, the one before it is at or before t
+        boost::circular_buffer<PoseSample, Eigen::aligned_allocator<PoseSample> >::const_iterator b =
+            std::upper_bound(_pose_history.begin(), _pose_history.end(), t, pose_sample_before);
+        const PoseSample &s0 = *(b - 1);
+        const PoseSample &s1 = *b;
+        double span = (s1.time - s0.time).toSec();
+        double s = span > 0.0 ? (t - s0.time).toSec() / span : 0.0;
+        position = s0.position + s * (s1.position - s0.position);
+        rotation = s0.rotation.slerp(s, s1.rotation);
+    }
+    pose << position, rotation.w(), rotation.x(), rotation.y(), rotation.z();
+    return true;
+}
+
+bool ESKF::get_latest_pose_time(ros::Time &t) const {
+    if(_pose_history.empty()) return false;
+    t = _pose_history.back().time;
+    return true;
+}
+
 void ESKF::publish_odom() {
     nav_msgs::Odometry msg;
     msg.header.frame_id = "world";
@@ -386,6 +482,11 @@ void ESKF::publish_odom() {
 
     // publish message
     _odom_pub.publish(msg);
+
+    if(_first_odom) {
+        _first_odom = false;
+        ROS_INFO("ESKF: first odometry %0.3f s after start.", (ros::WallTime::now() - _start_time).toSec());
+    }
     _odom_vec.push_back(msg);
 }
 
@@ -409,10 +510,18 @@ void ESKF::publish_bias() {
 void ESKF::update_meas_mean(Eigen::Matrix<double, 6, 1> &mean_meas) {
     _m_position = mean_meas.block<3,1>(0,0);
     _m_theta = mean_meas.block<3,1>(3,0);
+    _m_info_form = false;
 }
 
 void ESKF::update_meas_cov(Eigen::Matrix<double, 6, 6> &cov_meas) {
     _m_pose_sigma = cov_meas;
+    _m_info_form = false;
+}
+
+void ESKF::update_meas_info(const Eigen::Matrix<double, 6, 6> &W, const Eigen::Matrix<double, 6, 1> &z) {
+    _m_info_sqrt = W;
+    _m_info_z = z;
+    _m_info_form = true;
 }
 
 void ESKF::update_meas_flag() {
@@ -420,25 +529,15 @@ void ESKF::update_meas_flag() {
 }
 
 void ESKF::update_error() {
-    // assume only pose measurement is used
-    Eigen::Matrix<double, 6, 15> H;
-    Eigen::Matrix3d I = Eigen::Matrix3d::Identity();
-    Eigen::Matrix3d Z = Eigen::Matrix3d::Zero();
-    H << Z, I, Z, Z, Z,
-         Z, Z, I, Z, Z;
-
-    // measurements
-    Eigen::Matrix<double, 6, 1> y;
-    y[0] = _m_position.x(); y[1] = _m_position.y(); y[2] = _m_position.z();
-    y[3] = _m_theta.x();    y[4] = _m_theta.y();    y[5] = _m_theta.z();
-
-    // kalman gain matrix
-    Eigen::Matrix<double, 15, 6> K;
-    K = _Sigma * H.transpose() * (H * _Sigma * H.transpose() + 1.0 * _m_pose_sigma).inverse();
-
-    // update error
     Eigen::Matrix<double, 15, 1> x;
-    x = K * y;
+    if(_m_info_form) {
+        x = update_pose_info(_m_info_sqrt, _m_info_z, _Sigma);
+    } else {
+        Eigen::Matrix<double, 6, 1> y;
+        y[0] = _m_position.x(); y[1] = _m_position.y(); y[2] = _m_position.z();
+        y[3] = _m_theta.x();    y[4] = _m_theta.y();    y[5] = _m_theta.z();
+        x = update_pose_cov(y, _m_pose_sigma, _Sigma);
+    }
 
     _d_velocity << x[0],  x[1],  x[2];
     _d_position << x[3],  x[4],  x[5];
@@ -446,12 +545,6 @@ void ESKF::update_error() {
     _d_bias_acc << x[9],  x[10], x[11];
     _d_bias_gyr << x[12], x[13], x[14];
     _d_rotation << angle_axis_to_rotation_matrix(_d_theta);
-
-    // update covariance
-    Eigen::Matrix<double, 15, 15> M;
-    M = Eigen::MatrixXd::Identity(15,15) - K*H;
-    _Sigma = M * _Sigma;// * M.transpose() + K * _m_pose_sigma * K.transpose();
-
 }
 
 void ESKF::update_state() {
@@ -77,6 +77,8 @@ std::vector<size_t> sort_index(const std::vector<T> v) {
 
 GPF::GPF(ros::NodeHandle &nh, boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map_ptr){
 
+    _start_time = ros::WallTime::now();
+    _first_correction = true;
 
     // initialize particles pointer
     nh.param("cloud_sigma",             _ray_sigma,             1.0);
@@ -84,6 +86,35 @@ GPF::GPF(ros::NodeHandle &nh, boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map
     nh.param("set_size",                _set_size,              500);
     nh.param("cloud_range",             _cloud_range,           20.0);
     nh.param("robot_frame",             _robot_frame,           std::string("/coax"));
+    nh.param("cloud_sort",              _cloud_sort,            true);
+    nh.param("profile_weighting",       _profile_weighting,     false);
+    nh.param("likelihood_model",        _likelihood_model,      std::string("field"));
+    nh.param("voxel_cache_bits",        _voxel_cache_bits,      18);
+    nh.param("sampling_mode",           _sampling_mode,         std::string("random"));
+    nh.param("rotation_samples",        _rotation_samples,      20);
+    nh.param("snap_offsets",            _snap_offsets,          true);
+    nh.param("gn_iterations",           _gn_iterations,         0);
+    nh.param("gn_proposal_scale",       _gn_proposal_scale,     2.0);
+    nh.param("lidar_sync_window",       _lidar_sync_window,     0.05);
+    nh.param("wedge_period",            _wedge_period,          0.0);
+    nh.param("scan_static_extrinsic",   _scan_static_extrinsic, false);
+    nh.param("deskew_enabled",          _deskew_enabled,        false);
+    nh.param("deskew_time_field",       _deskew_time_field,     std::string("time"));
+    nh.param("deskew_time_scale",       _deskew_time_scale,     1.0);
+    nh.param("deskew_time_absolute",    _deskew_time_absolute,  false);
+    nh.param("downsample_mode",         _downsample_mode,       std::string("uniform"));
+    nh.param("point_budget",            _point_budget,          400);
+    nh.param("outlier_filter",          _outlier_filter,        false);
+    nh.param("outlier_sigmas",          _outlier_sigmas,        3.0);
+    nh.param("outlier_max_ratio",       _outlier_max_ratio,     0.5);
+    nh.param("debug_rate",              _debug_rate,            5.0);
+    nh.param("gate_enabled",            _gate_enabled,          false);
+    nh.param("gate_velocity",           _gate_velocity,         0.2);
+    nh.param("gate_cov_growth",         _gate_cov_growth,       2.0);
+    nh.param("gate_distance",           _gate_distance,         0.3);
+    nh.param("gate_max_interval",       _gate_max_interval,     1.0);
+    nh.param("gate_light_size",         _gate_light_size,       100);
+    nh.param("path_length",             _path_length,           400);
 
     _mean_prior.setZero();
     _mean_sample.setZero();
@@ -96,8 +127,31 @@ GPF::GPF(ros::NodeHandle &nh, boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map
     _cov_sample.setZero();
     _cov_posterior.setZero();
     _cov_meas.setZero();
-
-    _cloud_sub = nh.subscribe("cloud", 1, &GPF::cloud_callback, this);
+    _meas_info_sqrt.setZero();
+    _meas_info_z.setZero();
+    _scans = 0;
+    _scan_angle_min = 0.0f;
+    _scan_angle_increment = 0.0f;
+    _scan_extrinsic_cached = false;
+    _rejected_scans = 0;
+    _last_cov_trace = 0.0;
+    _gated_scans[GATE_FULL] = _gated_scans[GATE_LIGHT] = _gated_scans[GATE_SKIP] = 0;
+
+    // several lidars replace the single cloud topic
+    std::vector<std::string> lidar_topics;
+    nh.param("lidar_topics",            lidar_topics,           std::vector<std::string>());
+    _lidars.resize(lidar_topics.size());
+    for(size_t i=0; i<lidar_topics.size(); i++) {
+        _lidars[i].topic = lidar_topics[i];
+        _lidars[i].extrinsic_cached = false;
+        _lidars[i].sub = nh.subscribe<sensor_msgs::PointCloud2>(lidar_topics[i], 1,
+                             boost::bind(&GPF::lidar_callback, this, _1, int(i)));
+    }
+    if(_lidars.empty()) {
+        _cloud_sub = nh.subscribe("cloud", 1, &GPF::cloud_callback, this);
+    } else {
+        _lidar_timer = nh.createTimer(ros::Duration(_lidar_sync_window), &GPF::lidar_timer_callback, this, true, false);
+    }
     _scan_sub  = nh.subscribe("scan", 1, &GPF::scan_callback, this);
     _pozyx_sub = nh.subscribe("/pozyx_pose_cov", 1, &GPF::pozyx_callback, this);
 
@@ -107,39 +161,145 @@ GPF::GPF(ros::NodeHandle &nh, boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map
     _post_pub = nh.advertise<nav_msgs::Odometry>("posterior", 10);
     _path_pub = nh.advertise<nav_msgs::Path>("path", 1);
     _pose_pub = nh.advertise<geometry_msgs::PoseStamped>("pose", 10);
+    _outlier_pub = nh.advertise<std_msgs::Float32>("outlier_ratio", 10);
 
     // initialize eskf
     _eskf_ptr = boost::shared_ptr<ESKF> (new ESKF(nh));
 
+    // prepare the distance field around the initial pose, once it is loaded
+    Eigen::Matrix<double, 7, 1> init_pose;
+    _eskf_ptr->get_mean_pose(init_pose);
+    _map_ptr->warm_up(octomap::point3d(init_pose(0), init_pose(1), init_pose(2)), _cloud_range);
+
     // initialize particle
     _particles_ptr = boost::shared_ptr<Particles> (new Particles(map_ptr));
     _particles_ptr->set_raysigma(_ray_sigma);
     _particles_ptr->set_size(_set_size);
+    _particles_ptr->set_profiling(_profile_weighting);
+    _particles_ptr->set_likelihood_model(_likelihood_model);
+    _particles_ptr->set_voxel_cache(_voxel_cache_bits);
+    _particles_ptr->set_sampling(_sampling_mode, _rotation_samples, _snap_offsets);
+    _set_size = _particles_ptr->get_pset().size();
+    _active_set_size = _set_size;
+
+    if(_outlier_filter && _map_ptr->get_max_obstacle_dist() <= 2.0 * _ray_sigma) {
+        ROS_WARN("GPF: max_obstacle_dist %0.2f is not above 2 cloud_sigma, the outlier filter cannot drop points.",
+                 _map_ptr->get_max_obstacle_dist());
+    }
+    if(_downsample_mode != "uniform" && _downsample_mode != "info") {
+        ROS_WARN("GPF: unknown downsample mode \"%s\", using uniform.", _downsample_mode.c_str());
+    }
+    _info_selection = _downsample_mode == "info" && _point_budget > 0;
 
+    _debug_pending = false;
+    _debug_stop = false;
+    if(_debug_rate > 0.0) {
+        _debug_thread = boost::thread(&GPF::debug_loop, this);
+    }
 }
 
-GPF::~GPF() {}
+GPF::~GPF() {
+    {
+        boost::mutex::scoped_lock lock(_debug_mutex);
+        _debug_stop = true;
+    }
+    _debug_cond.notify_one();
+    if(_debug_thread.joinable()) {
+        _debug_thread.join();
+    }
+}
 
 void GPF::scan_callback(const sensor_msgs::LaserScan &msg) {
-    // convert laser scan to point cloud
+    if(!_map_ptr->is_ready()) {
+        ROS_INFO_THROTTLE(1.0, "GPF: waiting for the map, scan skipped.");
+        return;
+    }
 
-    if(!_listener.waitForTransform(
-        msg.header.frame_id,
-        _robot_frame,
-        msg.header.stamp + ros::Duration().fromSec(msg.ranges.size()*msg.time_increment),
-        ros::Duration(0.1))) {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+    std::vector<float> times;
+    if(!project_scan(msg, *cloud_ptr, times)) {
         ROS_WARN("GPF: scan transform is not found, time out.");
         return;
     }
+    ingest(cloud_ptr, times, msg.header.stamp);
+}
+
+bool GPF::lookup_extrinsic(const std::string &frame, const ros::Time &stamp,
+                           Eigen::Matrix3f &rotation, Eigen::Vector3f &translation) {
+    tf::StampedTransform transform;
+    try {
+        _listener.lookupTransform(_robot_frame, frame, stamp, transform);
+    } catch(tf::TransformException &ex) {
+        return false;
+    }
+    Eigen::Affine3d extrinsic;
+    tf::transformTFToEigen(transform, extrinsic);
+    rotation = extrinsic.linear().cast<float>();
+    translation = extrinsic.translation().cast<float>();
+    return true;
+}
+
+bool GPF::project_scan(const sensor_msgs::LaserScan &msg, pcl::PointCloud<pcl::PointXYZ> &cloud,
+                       std::vector<float> &times) {
+    const int n = msg.ranges.size();
+    if(n == 0) return true;
+
+    // trig tables only change with the scan configuration
+    if(n != int(_scan_cos.size()) || msg.angle_min != _scan_angle_min ||
+       msg.angle_increment != _scan_angle_increment) {
+        _scan_angle_min = msg.angle_min;
+        _scan_angle_increment = msg.angle_increment;
+        _scan_cos.resize(n);
+        _scan_sin.resize(n);
+        for(int i=0; i<n; i++) {
+            double angle = msg.angle_min + i * msg.angle_increment;
+            _scan_cos[i] = cos(angle);
+            _scan_sin[i] = sin(angle);
+        }
+    }
 
-    sensor_msgs::PointCloud2 cloud;
-    _projector.transformLaserScanToPointCloud(_robot_frame, msg, cloud, _listener, _cloud_range);
+    // laser frame in the robot frame at the first and the last beam, once
+    // for a fixed mount
+    ros::Time stamp_end = msg.header.stamp + ros::Duration().fromSec((n - 1) * msg.time_increment);
+    if(!_scan_static_extrinsic || !_scan_extrinsic_cached) {
+        if(!_listener.waitForTransform(msg.header.frame_id, _robot_frame, stamp_end, ros::Duration(0.1)) ||
+           !lookup_extrinsic(msg.header.frame_id, msg.header.stamp, _scan_rotation[0], _scan_translation[0]) ||
+           !lookup_extrinsic(msg.header.frame_id, stamp_end, _scan_rotation[1], _scan_translation[1])) {
+            return false;
+        }
+        _scan_extrinsic_cached = true;
+    }
 
-    // call cloud_callback function
-    cloud_callback(cloud);
+    const float range_min = std::max(double(msg.range_min), 0.0);
+    const float range_max = std::min(double(msg.range_max), _cloud_range);
+    const float blend = n > 1 ? 1.0f / (n - 1) : 0.0f;
+    cloud.clear();
+    cloud.reserve(n);
+    times.clear();
+    times.reserve(n);
+    for(int i=0; i<n; i++) {
+        float r = msg.ranges[i];
+        if(!(r >= range_min && r <= range_max)) continue;
+
+        // the mount may move during the scan, blend the two extrinsics
+        float a = i * blend;
+        Eigen::Vector3f p0 = _scan_rotation[0].col(0) * (r * _scan_cos[i]) +
+                             _scan_rotation[0].col(1) * (r * _scan_sin[i]) + _scan_translation[0];
+        Eigen::Vector3f p1 = _scan_rotation[1].col(0) * (r * _scan_cos[i]) +
+                             _scan_rotation[1].col(1) * (r * _scan_sin[i]) + _scan_translation[1];
+        Eigen::Vector3f p = (1.0f - a) * p0 + a * p1;
+        cloud.push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+        times.push_back(i * msg.time_increment);
+    }
+    return true;
 }
+
 void GPF::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
-    _laser_time = msg.header.stamp;
+    if(!_map_ptr->is_ready()) {
+        ROS_INFO_THROTTLE(1.0, "GPF: waiting for the map, cloud skipped.");
+        return;
+    }
+
     pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
     pcl::PointCloud<pcl::PointXYZ>  cloud_temp;
     pcl::fromROSMsg(msg, cloud_temp);
@@ -153,6 +313,257 @@ void GPF::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
     }
 
     pcl_ros::transformPointCloud(_robot_frame, cloud_temp, *cloud_ptr, _listener);
+
+    std::vector<float> times;
+    if(_deskew_enabled && !read_point_times(msg, times)) {
+        times.clear();
+    }
+    ingest(cloud_ptr, times, msg.header.stamp);
+}
+
+void GPF::lidar_callback(const sensor_msgs::PointCloud2ConstPtr &msg, int sensor) {
+    if(!_map_ptr->is_ready()) {
+        ROS_INFO_THROTTLE(1.0, "GPF: waiting for the map, cloud skipped.");
+        return;
+    }
+
+    LidarSensor &lidar = _lidars[sensor];
+    if(!lidar.extrinsic_cached) {
+        if(!_listener.waitForTransform(msg->header.frame_id, _robot_frame, ros::Time(0), ros::Duration(0.1)) ||
+           !lookup_extrinsic(msg->header.frame_id, ros::Time(0), lidar.rotation, lidar.translation)) {
+            ROS_WARN("GPF: transform of %s is not found, time out.", lidar.topic.c_str());
+            return;
+        }
+        lidar.extrinsic_cached = true;
+    }
+
+    // a sensor that reports again closes the batch, as does one whose
+    // cloud is too far from the oldest pending one
+    ros::Time oldest = msg->header.stamp;
+    for(size_t i=0; i<_lidars.size(); i++) {
+        if(_lidars[i].pending && _lidars[i].stamp < oldest) oldest = _lidars[i].stamp;
+    }
+    if(lidar.pending || (msg->header.stamp - oldest).toSec() > _lidar_sync_window) {
+        flush_lidars();
+    }
+
+    pcl::PointCloud<pcl::PointXYZ> cloud_temp;
+    pcl::fromROSMsg(*msg, cloud_temp);
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+    cloud_ptr->reserve(cloud_temp.size());
+    for(size_t i=0; i<cloud_temp.size(); i++) {
+        Eigen::Vector3f p = lidar.rotation * cloud_temp[i].getVector3fMap() + lidar.translation;
+        cloud_ptr->push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+    }
+
+    if(_deskew_enabled) {
+        std::vector<float> times;
+        if(!read_point_times(*msg, times)) {
+            times.clear();
+        }
+        deskew_timed(*cloud_ptr, times, msg->header.stamp, lidar.topic);
+    }
+
+    // the sync window starts with the first cloud of a batch
+    bool first = true;
+    for(size_t i=0; i<_lidars.size(); i++) {
+        if(_lidars[i].pending) first = false;
+    }
+    if(first) {
+        _lidar_timer.stop();
+        _lidar_timer.setPeriod(ros::Duration(_lidar_sync_window));
+        _lidar_timer.start();
+    }
+    lidar.stamp = msg->header.stamp;
+    lidar.pending = cloud_ptr;
+
+    for(size_t i=0; i<_lidars.size(); i++) {
+        if(!_lidars[i].pending) return;
+    }
+    flush_lidars();
+}
+
+void GPF::lidar_timer_callback(const ros::TimerEvent &event) {
+    flush_lidars();
+}
+
+void GPF::flush_lidars() {
+    _lidar_timer.stop();
+    CloudSlices slices;
+    for(size_t i=0; i<_lidars.size(); i++) {
+        if(!_lidars[i].pending) continue;
+        slices.push_back(std::make_pair(_lidars[i].stamp, _lidars[i].pending));
+        _lidars[i].pending.reset();
+    }
+    if(slices.empty()) return;
+    if(slices.size() < _lidars.size()) {
+        ROS_INFO_THROTTLE(1.0, "GPF: %d of %d lidars within the sync window.", int(slices.size()), int(_lidars.size()));
+    }
+
+    // one weighting pass and one eskf measurement for all sensors
+    std::sort(slices.begin(), slices.end(), [](const CloudSlices::value_type &a, const CloudSlices::value_type &b) {
+        return a.first < b.first;
+    });
+    ros::Time batch_time;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr batch_ptr = assemble_slices(slices, batch_time);
+    correct(batch_ptr, batch_time);
+}
+
+void GPF::ingest(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr, const std::vector<float> &times,
+                 const ros::Time &stamp) {
+    if(_deskew_enabled) {
+        deskew_timed(*cloud_ptr, times, stamp, "the cloud");
+    }
+
+    if(_wedge_period <= 0.0) {
+        correct(cloud_ptr, stamp);
+        return;
+    }
+
+    // collect sweep slices until the wedge spans _wedge_period, and while
+    // the eskf has not applied the previous wedge, which would otherwise be
+    // overwritten and its prior be stale
+    _wedge.push_back(std::make_pair(stamp, cloud_ptr));
+    if((stamp - _wedge.front().first).toSec() < _wedge_period) return;
+    if(_eskf_ptr->has_pending_meas()) return;
+
+    ros::Time wedge_time;
+    pcl::PointCloud<pcl::PointXYZ>::Ptr wedge_ptr = assemble_slices(_wedge, wedge_time);
+    _wedge.clear();
+    correct(wedge_ptr, wedge_time);
+}
+
+// largest time in s of a point away from its cloud stamp
+static const double DESKEW_MAX_OFFSET = 1.0;
+
+bool GPF::read_point_times(const sensor_msgs::PointCloud2 &msg, std::vector<float> &times) {
+    const sensor_msgs::PointField *f = NULL;
+    for(size_t i=0; i<msg.fields.size(); i++) {
+        if(msg.fields[i].name == _deskew_time_field) f = &msg.fields[i];
+    }
+    if(f == NULL) return false;
+    if(msg.is_bigendian) {
+        ROS_WARN_THROTTLE(5.0, "GPF: big endian point times are not supported.");
+        return false;
+    }
+
+    size_t n = size_t(msg.width) * msg.height;
+    times.resize(n);
+    // absolute stamps are made relative to the header
+    double offset = _deskew_time_absolute ? msg.header.stamp.toSec() : 0.0;
+    for(size_t i=0; i<n; i++) {
+        const boost::uint8_t *p = &msg.data[(i / msg.width) * msg.row_step +
+                                            (i % msg.width) * msg.point_step + f->offset];
+        double t;
+        switch(f->datatype) {
+        case sensor_msgs::PointField::FLOAT32: { float v; memcpy(&v, p, sizeof(v)); t = v; break; }
+        case sensor_msgs::PointField::FLOAT64: { double v; memcpy(&v, p, sizeof(v)); t = v; break; }
+        case sensor_msgs::PointField::UINT32:  { boost::uint32_t v; memcpy(&v, p, sizeof(v)); t = v; break; }
+        case sensor_msgs::PointField::INT32:   { boost::int32_t v; memcpy(&v, p, sizeof(v)); t = v; break; }
+        default: return false;
+        }
+        times[i] = t * _deskew_time_scale - offset;
+        // a wrong scale or absolute setting puts points far from the stamp
+        if(!(fabs(times[i]) <= DESKEW_MAX_OFFSET)) {
+            ROS_WARN_THROTTLE(5.0, "GPF: point time %0.3f s away from the cloud stamp, check "
+                              "deskew_time_scale and deskew_time_absolute.", double(times[i]));
+            return false;
+        }
+    }
+    return true;
+}
+
+void GPF::deskew_timed(pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<float> &times,
+                       const ros::Time &stamp, const std::string &source) {
+    if(!times.empty() && times.size() == cloud.size()) {
+        deskew(cloud, times, stamp);
+    } else if(!cloud.empty()) {
+        ROS_WARN_THROTTLE(5.0, "GPF: no per point times in %s, not deskewed.", source.c_str());
+    }
+}
+
+void GPF::deskew(pcl::PointCloud<pcl::PointXYZ> &cloud, const std::vector<float> &times,
+                 const ros::Time &stamp) {
+    int n = cloud.size();
+    if(n == 0) return;
+    float t_min = *std::min_element(times.begin(), times.end());
+    float t_max = *std::max_element(times.begin(), times.end());
+
+    // motion relative to the robot frame at stamp, sampled at a few knots
+    // and blended linearly in between
+    int knots = DESKEW_KNOTS;
+    if(t_max - t_min <= 1e-6f) knots = 1;
+    Eigen::Matrix<double, 7, 1> pose_ref, pose;
+    if(!_eskf_ptr->get_pose_at(stamp, pose_ref)) {
+        ROS_WARN_THROTTLE(5.0, "GPF: cloud older than the pose history, not deskewed.");
+        return;
+    }
+    Eigen::Quaterniond rotation_ref_inv = Eigen::Quaterniond(pose_ref[3], pose_ref[4], pose_ref[5], pose_ref[6]).inverse();
+    Eigen::Vector3d translation_ref = pose_ref.block<3,1>(0,0);
+
+    Eigen::Matrix<float, 12, DESKEW_KNOTS> knot;
+    for(int k=0; k<knots; k++) {
+        double t = knots > 1 ? t_min + (t_max - t_min) * k / (knots - 1) : t_min;
+        if(!_eskf_ptr->get_pose_at(stamp + ros::Duration(t), pose)) return;
+        Eigen::Matrix3d R = (rotation_ref_inv *
+            Eigen::Quaterniond(pose[3], pose[4], pose[5], pose[6])).toRotationMatrix();
+        Eigen::Vector3d T = rotation_ref_inv * (pose.block<3,1>(0,0) - translation_ref);
+        for(int j=0; j<9; j++) knot(j, k) = R(j);
+        for(int j=0; j<3; j++) knot(9 + j, k) = T(j);
+    }
+
+    const float scale = knots > 1 ? (knots - 1) / (t_max - t_min) : 0.0f;
+    for(int i=0; i<n; i++) {
+        float s = (times[i] - t_min) * scale;
+        int k = std::min(std::max(int(s), 0), std::max(knots - 2, 0));
+        float a = knots > 1 ? std::min(std::max(s - k, 0.0f), 1.0f) : 0.0f;
+        Eigen::Matrix<float, 12, 1> m = (1.0f - a) * knot.col(k) + a * knot.col(std::min(k + 1, knots - 1));
+        pcl::PointXYZ &p = cloud[i];
+        float x = p.x, y = p.y, z = p.z;
+        // column major rotation followed by the translation
+        p.x = m(0) * x + m(3) * y + m(6) * z + m(9);
+        p.y = m(1) * x + m(4) * y + m(7) * z + m(10);
+        p.z = m(2) * x + m(5) * y + m(8) * z + m(11);
+    }
+}
+
+pcl::PointCloud<pcl::PointXYZ>::Ptr GPF::assemble_slices(const CloudSlices &slices, ros::Time &stamp) {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr merged_ptr = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+
+    // every slice is moved to the robot frame at the newest eskf pose, the
+    // prior of the update, so the lag behind the imu is compensated too
+    Eigen::Matrix<double, 7, 1> pose_end, pose;
+    bool compensate = _eskf_ptr->get_latest_pose_time(stamp) && _eskf_ptr->get_pose_at(stamp, pose_end);
+    if(!compensate || stamp < slices.back().first) {
+        stamp = slices.back().first;
+    }
+    Eigen::Quaterniond rotation_end(pose_end[3], pose_end[4], pose_end[5], pose_end[6]);
+    Eigen::Vector3d translation_end = pose_end.block<3,1>(0,0);
+
+    int uncompensated = 0;
+    for(size_t i=0; i<slices.size(); i++) {
+        if(!compensate || !_eskf_ptr->get_pose_at(slices[i].first, pose)) {
+            *merged_ptr += *slices[i].second;
+            uncompensated++;
+            continue;
+        }
+        Eigen::Quaterniond rotation(pose[3], pose[4], pose[5], pose[6]);
+        Eigen::Vector3d translation = pose.block<3,1>(0,0);
+        pcl::PointCloud<pcl::PointXYZ> slice;
+        pcl::transformPointCloud(*slices[i].second,
+                                 slice,
+                                 rotation_end.inverse() * (translation - translation_end),
+                                 rotation_end.inverse() * rotation);
+        *merged_ptr += slice;
+    }
+    if(uncompensated > 0) {
+        ROS_WARN_THROTTLE(1.0, "GPF: %d slices older than the pose history.", uncompensated);
+    }
+    return merged_ptr;
+}
+
+void GPF::correct(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr, const ros::Time &stamp) {
+    _laser_time = stamp;
     _cloud_ptr = cloud_ptr;
 
     downsample();
@@ -160,29 +571,78 @@ void GPF::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
     // request prior from eskf
     _eskf_ptr->get_mean_pose(_mean_prior);
     _eskf_ptr->get_cov_pose(_cov_prior);
-    
-    
+
     // draw particles and propagate
     _particles_ptr->set_mean(_mean_prior);
     _particles_ptr->set_cov(_cov_prior);
     _particles_ptr->set_cloud(_cloud_ptr);
+
+    // skip or lighten scans that would add little information, before the
+    // point selection is paid for
+    GateDecision gate = _gate_enabled ? gate_update() : GATE_FULL;
+    _gated_scans[gate]++;
+    if(_gate_enabled) {
+        ROS_INFO_THROTTLE(5.0, "GPF: gated scans: %d full, %d light, %d skipped.",
+                          _gated_scans[GATE_FULL], _gated_scans[GATE_LIGHT], _gated_scans[GATE_SKIP]);
+    }
+    if(gate == GATE_SKIP) {
+        publish_tf();
+        return;
+    }
+    use_set_size(gate == GATE_LIGHT ? _gate_light_size : _set_size);
+
+    if(_outlier_filter || _info_selection) {
+        if(_outlier_filter) {
+            filter_outliers();
+        }
+        if(_info_selection) {
+            select_informative();
+        }
+        _particles_ptr->set_cloud(_cloud_ptr);
+    }
+
+    if(_gn_iterations > 0 && !_particles_ptr->refine_proposal(_gn_iterations, _gn_proposal_scale)) {
+        ROS_WARN_THROTTLE(1.0, "GPF: gauss-newton refinement failed, sampling from the prior.");
+    }
     _particles_ptr->propagate(_mean_sample, _cov_sample,
                               _mean_posterior, _cov_posterior);
 
-    // update meas in eskf
-    recover_meas();
-    
-    // check if the recovered pseudo mesure is valid
-    for(int i=0; i<_mean_meas.size(); i++) {
-        if(isnan(_mean_meas(i))) return;
+    if(_profile_weighting && !_cloud_ptr->empty()) {
+        boost::uint64_t l1_misses, llc_misses;
+        _particles_ptr->get_cache_misses(l1_misses, llc_misses);
+        double lookups = double(_particles_ptr->get_pset().size()) * _cloud_ptr->size();
+        ROS_INFO_THROTTLE(1.0, "GPF: weighting cache misses per lookup: L1D %0.3f, LLC %0.4f",
+                          l1_misses / lookups, llc_misses / lookups);
     }
-    for(int i=0; i<_cov_meas.size(); i++) {
-        if(isnan(_cov_meas(i))) return;
+
+    boost::uint64_t cache_hits, cache_lookups;
+    _particles_ptr->get_voxel_cache_stats(cache_hits, cache_lookups);
+    if(_profile_weighting && cache_lookups > 0) {
+        ROS_INFO_THROTTLE(1.0, "GPF: voxel cache hit rate %0.1f%%", 100.0 * cache_hits / cache_lookups);
+    }
+
+    // update meas in eskf
+    _scans++;
+    if(!recover_meas()) {
+        _rejected_scans++;
+        // forces the next update to be full
+        _last_cov_trace = 0.0;
+        ROS_WARN_THROTTLE(1.0, "GPF: no measurement recovered, %d of %d scans rejected.", _rejected_scans, _scans);
+        return;
     }
+
     // update eskf
-    _eskf_ptr->update_meas_mean(_mean_meas);
-    _eskf_ptr->update_meas_cov(_cov_meas);
+    _eskf_ptr->update_meas_info(_meas_info_sqrt, _meas_info_z);
     _eskf_ptr->update_meas_flag();
+    if(gate == GATE_FULL) {
+        _last_full_update = _laser_time;
+    }
+    _last_cov_trace = _cov_posterior.trace();
+
+    if(_first_correction) {
+        _first_correction = false;
+        ROS_INFO("GPF: first correction %0.3f s after start.", (ros::WallTime::now() - _start_time).toSec());
+    }
 
 
     /* TESTING PARTICLE FILTER RESUTLS*/
@@ -194,13 +654,10 @@ void GPF::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
 //    std::cout<< "cov meas:\n" << _cov_meas.diagonal().transpose()<<std::endl;
 
     // publish needed resutls
-    publish_pset();
-    publish_cloud();
     publish_posterior();
-    publish_path();
     publish_meas();
     publish_tf();
-    //publish_pose();
+    publish_debug();
 
 }
 
@@ -281,41 +738,279 @@ void GPF::downsample() {
 	}
     }
 
+    if(_cloud_sort) {
+        sort_cloud();
+    }
+
     ROS_INFO_STREAM_THROTTLE(1.0, "GPF: Cloud size " << int(_cloud_ptr->size()));
 }
 
-void GPF::recover_meas() {
-    Eigen::Matrix<double, 6, 6> K;
+void GPF::filter_outliers() {
+    int n = _cloud_ptr->size();
+    if(n == 0) return;
+
+    // every end point once at the prior mean
+    Eigen::Matrix3f R = Eigen::Quaterniond(_mean_prior[3], _mean_prior[4],
+                                           _mean_prior[5], _mean_prior[6]).toRotationMatrix().cast<float>();
+    Eigen::Vector3f t = _mean_prior.block<3,1>(0,0).cast<float>();
+    std::vector<float> x(n), y(n), z(n), range(n), dist(n);
+    for(int i=0; i<n; i++) {
+        Eigen::Vector3f p = (*_cloud_ptr)[i].getVector3fMap();
+        Eigen::Vector3f q = R * p + t;
+        x[i] = q.x();
+        y[i] = q.y();
+        z[i] = q.z();
+        range[i] = p.norm();
+    }
+    _map_ptr->get_dist(&x[0], &y[0], &z[0], n, &dist[0]);
+
+    // the field likelihood is flat beyond 2 sigma or the saturation of the
+    // field, whichever comes first, so a point at least that far from the
+    // map for every pose within the prior margin scores the same for all
+    // particles. A saturated distance is only a lower bound.
+    const float saturation = _map_ptr->get_max_obstacle_dist();
+    const float saturated = saturation - _map_ptr->get_map()->getResolution();
+    const float flat = std::min(2.0 * _ray_sigma, double(saturation));
+    const float sigma_t = _outlier_sigmas * sqrt(_cov_prior.block<3,3>(0,0).trace());
+    const float sigma_r = _outlier_sigmas * sqrt(_cov_prior.block<3,3>(3,3).trace());
+    std::vector<char> keep(n);
+    int dropped = 0;
+    for(int i=0; i<n; i++) {
+        float d = dist[i] >= saturated ? saturation : dist[i];
+        keep[i] = !(d >= flat + sigma_t + range[i] * sigma_r);
+        dropped += !keep[i];
+    }
+
+    // most of the scan not fitting means the prior is off, not the scan
+    double ratio = double(dropped) / n;
+    if(ratio > _outlier_max_ratio) {
+        ROS_WARN_THROTTLE(1.0, "GPF: %0.0f%% of the points do not fit the map at the prior, none dropped.", 100.0 * ratio);
+        ratio = 0.0;
+    } else if(dropped > 0) {
+        pcl::PointCloud<pcl::PointXYZ>::Ptr inliers = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+        inliers->reserve(n - dropped);
+        for(int i=0; i<n; i++) {
+            if(keep[i]) inliers->push_back((*_cloud_ptr)[i]);
+        }
+        _cloud_ptr = inliers;
+    }
 
-    _cov_meas = (_cov_posterior.inverse() - _cov_sample.inverse()).inverse();
-    check_posdef(_cov_meas);
-    K = _cov_sample * ( _cov_sample + _cov_meas).inverse();
-    _mean_meas = K.inverse() * (_mean_posterior - _mean_sample) + _mean_sample;
+    if(_outlier_pub.getNumSubscribers() > 0) {
+        std_msgs::Float32 msg;
+        msg.data = ratio;
+        _outlier_pub.publish(msg);
+    }
 }
 
-void GPF::check_posdef(Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> &R) {
-    Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> rot;
-    Eigen::Matrix<double, STATE_SIZE, 1> scl;
+void GPF::select_informative() {
+    int n = _cloud_ptr->size();
+    if(n <= _point_budget) return;
+
+    // distance field gradient of every candidate at the prior mean
+    Eigen::Quaterniond rotation(_mean_prior[3], _mean_prior[4], _mean_prior[5], _mean_prior[6]);
+    Eigen::Matrix3d R = rotation.toRotationMatrix();
+    Eigen::Matrix3f Rf = R.cast<float>();
+    Eigen::Vector3f t = _mean_prior.block<3,1>(0,0).cast<float>();
+    std::vector<float> x(n), y(n), z(n), dist(n), gx(n), gy(n), gz(n);
+    double length = 0.0;
+    for(int i=0; i<n; i++) {
+        Eigen::Vector3f p = (*_cloud_ptr)[i].getVector3fMap();
+        Eigen::Vector3f q = Rf * p + t;
+        x[i] = q.x();
+        y[i] = q.y();
+        z[i] = q.z();
+        length += p.norm();
+    }
+    length = std::max(length / n, 1.0);
+    _map_ptr->get_dist_grad(&x[0], &y[0], &z[0], n, &dist[0], &gx[0], &gy[0], &gz[0]);
+
+    // rows of the pose jacobian as in Particles::refine_proposal, rotations
+    // scaled by the mean range so that all six columns are in meters
+    ErrorStates J;
+    std::vector<int> index;
+    J.reserve(n);
+    index.reserve(n);
+    Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+    for(int i=0; i<n; i++) {
+        Eigen::Vector3d g(gx[i], gy[i], gz[i]);
+        if(dist[i] < 0.0f || g.squaredNorm() < 1e-6) continue;
+        Eigen::Vector3d p = (*_cloud_ptr)[i].getVector3fMap().cast<double>();
+        Eigen::Matrix<double, 6, 1> row;
+        row << g, p.cross(R.transpose() * g) / length;
+        H.noalias() += row * row.transpose();
+        J.push_back(row);
+        index.push_back(i);
+    }
+
+    // project onto the principal directions of the scan information, one
+    // candidate list per direction from strongest to weakest
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 6, 6> > solver(H);
+    const Eigen::Matrix<double, 6, 6> V = solver.eigenvectors();
+    int m = index.size();
+    std::vector<std::vector<std::pair<double, int> > > lists(6, std::vector<std::pair<double, int> >(m));
+    for(int j=0; j<m; j++) {
+        Eigen::Matrix<double, 6, 1> c = V.transpose() * J[j];
+        J[j] = c.cwiseAbs2();
+        for(int k=0; k<6; k++) lists[k][j] = std::make_pair(-J[j][k], j);
+    }
+    double strongest = 0.0;
+    for(int k=0; k<6; k++) {
+        std::sort(lists[k].begin(), lists[k].end());
+        if(m > 0) strongest = std::max(strongest, -lists[k][0].first);
+    }
 
-    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> >
-       eigenSolver(R);
-    rot = eigenSolver.eigenvectors();
-    scl = eigenSolver.eigenvalues();
+    // always feed the direction that is constrained least so far, but not
+    // with points that barely see it, or a direction the scene cannot
+    // observe would take the whole budget
+    const double weakest = 1e-2 * strongest;
+    std::vector<char> keep(n, 0);
+    std::vector<int> next(6, 0);
+    Eigen::Matrix<double, 6, 1> info = Eigen::Matrix<double, 6, 1>::Zero();
+    int selected = 0;
+    while(selected < _point_budget) {
+        int k = -1;
+        for(int l=0; l<6; l++) {
+            if(next[l] == m || -lists[l][next[l]].first < weakest) continue;
+            if(k < 0 || info[l] < info[k]) k = l;
+        }
+        if(k < 0) break;
+        int j = lists[k][next[k]++].second;
+        if(keep[index[j]]) continue;
+        keep[index[j]] = 1;
+        info += J[j];
+        selected++;
+    }
 
-    Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> E;
-    E.setZero();
-    for (int ii=0; ii<STATE_SIZE; ++ii) {
-        if(scl(ii,0)>0.0) {
-            E(ii,ii) = scl(ii,0);
+    // spread what is left of the budget evenly over the other points
+    const int need = _point_budget - selected;
+    const int rest = n - selected;
+    for(int i=0, seen=0; i<n && need>0; i++) {
+        if(keep[i]) continue;
+        if(long(seen + 1) * need / rest > long(seen) * need / rest) {
+            keep[i] = 1;
+            selected++;
         }
-        else {
-            E(ii,ii) = 100.0;
+        seen++;
+    }
+
+    // original order, so the sorted cloud stays sorted
+    pcl::PointCloud<pcl::PointXYZ>::Ptr selection = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+    selection->reserve(selected);
+    for(int i=0; i<n; i++) {
+        if(keep[i]) selection->push_back((*_cloud_ptr)[i]);
+    }
+    _cloud_ptr = selection;
+
+    ROS_INFO_THROTTLE(1.0, "GPF: %d of %d points selected, weakest direction %0.2f of the strongest.",
+                      selected, n, solver.eigenvalues()[0] / std::max(solver.eigenvalues()[5], 1e-12));
+}
+
+void GPF::sort_cloud() {
+    // order the points along a Z-order curve, so that consecutive points of
+    // every reprojected copy look up nearby map cells
+    std::vector<std::pair<boost::uint64_t, int> > codes(_cloud_ptr->size());
+    for(size_t i=0; i<_cloud_ptr->size(); i++) {
+        const pcl::PointXYZ &p = (*_cloud_ptr)[i];
+        boost::uint32_t x = int(floor(p.x / _cloud_resol)) + (1 << 20);
+        boost::uint32_t y = int(floor(p.y / _cloud_resol)) + (1 << 20);
+        boost::uint32_t z = int(floor(p.z / _cloud_resol)) + (1 << 20);
+        codes[i] = std::make_pair(morton_encode(x, y, z), int(i));
+    }
+    std::sort(codes.begin(), codes.end());
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr sorted_cloud = pcl::PointCloud<pcl::PointXYZ>::Ptr (new pcl::PointCloud<pcl::PointXYZ>);
+    sorted_cloud->reserve(codes.size());
+    for(size_t i=0; i<codes.size(); i++) {
+        sorted_cloud->push_back((*_cloud_ptr)[codes[i].second]);
+    }
+    _cloud_ptr = sorted_cloud;
+}
+
+bool recover_pose_meas(const Eigen::Matrix<double, 6, 1> &mean_sample,
+                       const Eigen::Matrix<double, 6, 6> &cov_sample,
+                       const Eigen::Matrix<double, 6, 1> &mean_posterior,
+                       const Eigen::Matrix<double, 6, 6> &cov_posterior,
+                       Eigen::Matrix<double, 6, 6> &info_sqrt,
+                       Eigen::Matrix<double, 6, 1> &info_z,
+                       Eigen::Matrix<double, 6, 1> &mean_meas,
+                       Eigen::Matrix<double, 6, 6> &cov_meas) {
+    // generalized eigenvectors V with V^T S_sample V = I and
+    // V^T S_posterior V = diag(l), so that the measurement information
+    // S_posterior^-1 - S_sample^-1 is V diag(1/l - 1) V^T
+    Eigen::GeneralizedSelfAdjointEigenSolver<Eigen::Matrix<double, 6, 6> > solver(cov_posterior, cov_sample);
+    if(solver.info() != Eigen::Success) return false;
+    const Eigen::Matrix<double, 6, 6> &V = solver.eigenvectors();
+    const Eigen::Matrix<double, 6, 1> &l = solver.eigenvalues();
+
+    // information vector in the same basis
+    Eigen::Matrix<double, 6, 1> a = V.transpose() * mean_posterior;
+    Eigen::Matrix<double, 6, 1> b = V.transpose() * mean_sample;
+
+    // directions the posterior did not shrink carry no information
+    Eigen::Matrix<double, 6, 1> u, var;
+    int informative = 0;
+    info_sqrt.setZero();
+    info_z.setZero();
+    for(int i=0; i<STATE_SIZE; i++) {
+        double li = std::max(l[i], 1e-9);
+        double info = 1.0 / li - 1.0;
+        if(!(info > 1e-9) || !std::isfinite(info)) {
+            u[i] = 0.0;
+            var[i] = 100.0;
+            continue;
         }
+        u[i] = (a[i] / li - b[i]) / info;
+        var[i] = 1.0 / info;
+        info_sqrt.col(i) = sqrt(info) * V.col(i);
+        info_z[i] = sqrt(info) * u[i];
+        informative++;
+    }
+    if(informative == 0 || !info_sqrt.allFinite() || !info_z.allFinite()) return false;
+
+    // covariance form, only for the meas topic: u = V^T y
+    Eigen::Matrix<double, 6, 6> T = cov_sample * V;
+    mean_meas = T * u;
+    cov_meas = T * var.asDiagonal() * T.transpose();
+    return true;
+}
+
+bool GPF::recover_meas() {
+    return recover_pose_meas(_mean_sample, _cov_sample, _mean_posterior, _cov_posterior,
+                             _meas_info_sqrt, _meas_info_z, _mean_meas, _cov_meas);
+}
+
+GPF::GateDecision GPF::gate_update() {
+    // guaranteed full updates, and after a rejected scan
+    if(_last_full_update.isZero() || _last_cov_trace <= 0.0 ||
+       (_laser_time - _last_full_update).toSec() > _gate_max_interval) {
+        return GATE_FULL;
+    }
+
+    // the scan does not fit the map at the prior anymore
+    double distance = _particles_ptr->prior_distance();
+    if(distance < 0.0 || distance > _gate_distance) {
+        return GATE_FULL;
+    }
+
+    Eigen::Vector3d velocity;
+    _eskf_ptr->get_velocity(velocity);
+    bool moving = velocity.norm() > _gate_velocity;
+    bool uncertain = _cov_prior.trace() > _gate_cov_growth * _last_cov_trace;
+    if(!moving && !uncertain) {
+        return GATE_SKIP;
     }
-    R = rot * E * rot.inverse();
+    return _gate_light_size > 0 ? GATE_LIGHT : GATE_FULL;
+}
+
+void GPF::use_set_size(int set_size) {
+    if(set_size == _active_set_size) return;
+    _active_set_size = set_size;
+    _particles_ptr->set_size(set_size);
+    _particles_ptr->set_sampling(_sampling_mode, _rotation_samples, _snap_offsets);
 }
 
 void GPF::publish_meas() {
+    if(_meas_pub.getNumSubscribers() == 0) return;
     nav_msgs::Odometry msg;
 
     msg.header.stamp = _laser_time;
@@ -341,104 +1036,163 @@ void GPF::publish_meas() {
     _meas_pub.publish(msg);
 }
 
-void GPF::publish_pset() {
+void GPF::publish_debug() {
+    geometry_msgs::PoseStamped pose;
+    pose.header.frame_id = "world";
+    pose.header.stamp = _laser_time;
+    pose.pose.position.x = _mean_prior[0];
+    pose.pose.position.y = _mean_prior[1];
+    pose.pose.position.z = _mean_prior[2];
+    pose.pose.orientation.w = _mean_prior[3];
+    pose.pose.orientation.x = _mean_prior[4];
+    pose.pose.orientation.y = _mean_prior[5];
+    pose.pose.orientation.z = _mean_prior[6];
+
+    if(_pose_pub.getNumSubscribers() > 0) {
+        _pose_pub.publish(pose);
+    }
+    if(_debug_rate <= 0.0) return;
+
+    boost::mutex::scoped_lock lock(_debug_mutex);
+    // the path grows by one pose per correction
+    _debug_poses.push_back(pose);
+
+    ros::WallTime now = ros::WallTime::now();
+    if((now - _last_debug).toSec() < 1.0 / _debug_rate) return;
+    _last_debug = now;
+
+    DebugFrame &frame = _debug_frame;
+    frame.stamp = _laser_time;
+    frame.pose = _mean_prior;
+    frame.cloud.reset();
+    if(_cloud_pub.getNumSubscribers() > 0) {
+        // each scan gets a new cloud, this one is not modified anymore
+        frame.cloud = _cloud_ptr;
+    }
+    frame.particles.clear();
+    frame.weights.clear();
+    if(_pset_pub.getNumSubscribers() > 0) {
+        const std::vector<Particle> &pset = _particles_ptr->get_pset();
+        frame.particles.reserve(pset.size());
+        frame.weights.reserve(pset.size());
+        for(size_t i=0; i<pset.size(); i++) {
+            frame.particles.push_back(pset[i].translation.cast<float>());
+            frame.weights.push_back(pset[i].weight);
+        }
+        _particles_ptr->get_weight_range(frame.min_weight, frame.max_weight);
+    }
+    _debug_pending = true;
+    _debug_cond.notify_one();
+}
+
+void GPF::debug_loop() {
+    // debug output must not delay the corrections
+    struct sched_param param;
+    param.sched_priority = 0;
+    if(pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        ROS_WARN("GPF: could not lower the priority of the debug thread.");
+    }
+
+    DebugFrame frame;
+    std::vector<geometry_msgs::PoseStamped> poses;
+    while(true) {
+        {
+            boost::mutex::scoped_lock lock(_debug_mutex);
+            while(!_debug_pending && !_debug_stop) {
+                _debug_cond.wait(lock);
+            }
+            if(_debug_stop) return;
+            std::swap(frame, _debug_frame);
+            poses.swap(_debug_poses);
+            _debug_pending = false;
+        }
+
+        publish_pset(frame);
+        publish_cloud(frame);
+        publish_path(frame.stamp, poses);
+        poses.clear();
+    }
+}
+
+void GPF::publish_pset(const DebugFrame &frame) {
+    if(frame.particles.empty()) return;
+
+    // one POINTS marker instead of an arrow per particle
+    visualization_msgs::Marker m;
+    m.header.frame_id = "world";
+    m.header.stamp = frame.stamp;
+    m.ns = "particle_set";
+    m.id = 0;
+    m.type = visualization_msgs::Marker::POINTS;
+    m.action = visualization_msgs::Marker::ADD;
+    m.pose.orientation.w = 1.0;
+    m.scale.x = 0.03;
+    m.scale.y = 0.03;
+    m.points.resize(frame.particles.size());
+    m.colors.resize(frame.particles.size());
+    for(size_t i=0; i<frame.particles.size(); i++) {
+        m.points[i].x = frame.particles[i].x();
+        m.points[i].y = frame.particles[i].y();
+        m.points[i].z = frame.particles[i].z();
+        compute_color(frame.weights[i], frame.min_weight, frame.max_weight, m.colors[i]);
+    }
 
-    std::vector<std::vector<double> > c;
-    c = compute_color(*_particles_ptr);
-    std::vector<Particle> pset = _particles_ptr->get_pset();
+    // clears the arrow markers of older versions still shown in rviz
+    visualization_msgs::Marker clear;
+    clear.header = m.header;
+    clear.action = visualization_msgs::Marker::DELETEALL;
 
     visualization_msgs::MarkerArray msg;
+    msg.markers.push_back(clear);
+    msg.markers.push_back(m);
+    _pset_pub.publish(msg);
+}
 
-    for(int i=0; i<_set_size; i++) {
-
-        visualization_msgs::Marker m;
-        m.header.frame_id = "world";
-        m.header.stamp = _laser_time;
-        m.ns = "particle_set";
-        m.id = i;
-        m.type = visualization_msgs::Marker::ARROW;
-        m.action = visualization_msgs::Marker::ADD;
-        m.pose.position.x = pset[i].translation.x();
-        m.pose.position.y = pset[i].translation.y();
-        m.pose.position.z = pset[i].translation.z();
-        m.pose.orientation.w = pset[i].rotation.w();
-        m.pose.orientation.x = pset[i].rotation.x();
-        m.pose.orientation.y = pset[i].rotation.y();
-        m.pose.orientation.z = pset[i].rotation.z();
-        m.scale.x = 0.1;
-        m.scale.y = 0.01;
-        m.scale.z = 0.01;
-        m.color.a = 1.0;
-        m.color.r = c[i][0];
-        m.color.g = c[i][1];
-        m.color.b = c[i][2];
-
-        msg.markers.push_back(m);
-    }
-   _pset_pub.publish(msg);
-}
-
-std::vector< std::vector<double> > GPF::compute_color(Particles pSet) {
-
-    std::vector<Particle> particle = pSet.get_pset();
-    std::vector< std::vector<double> > color;
-
-    // find maximum and minimum weight
-    double minWeight = 999.9;
-    double maxWeight = -999.9;
-
-    for(int i=0; i<_set_size; i++) {
-        Particle p = particle[i];
-        if(p.weight > maxWeight) maxWeight = p.weight;
-        if(p.weight < minWeight) minWeight = p.weight;
-    }
-    double midWeight = (maxWeight + minWeight)/2.0;
-
-    // compute color for each particle
-    for(int i=0; i<particle.size(); i++) {
-
-        std::vector<double> cRGB;
-        Particle p = particle[i];
-        if(minWeight <= p.weight && p.weight < midWeight) {
-            cRGB.push_back((p.weight - minWeight)/(midWeight - minWeight));
-            cRGB.push_back(1.0);
-            cRGB.push_back(0.0);
-        }
-        else if(midWeight <= p.weight && p.weight <= maxWeight) {
-            cRGB.push_back(1.0);
-            cRGB.push_back(1.0 - (p.weight - midWeight)/(maxWeight - midWeight));
-            cRGB.push_back(0.0);
-        }
-        else {
-            cRGB.push_back(0.0);
-            cRGB.push_back(0.0);
-            cRGB.push_back(1.0);
+void GPF::compute_color(double weight, double min_weight, double max_weight, std_msgs::ColorRGBA &color) {
 
-        }
-        color.push_back(cRGB);
+    double mid_weight = (max_weight + min_weight)/2.0;
+    double half_range = std::max((max_weight - min_weight)/2.0, 1e-12);
+
+    color.a = 1.0;
+    if(min_weight <= weight && weight < mid_weight) {
+        color.r = (weight - min_weight)/half_range;
+        color.g = 1.0;
+        color.b = 0.0;
+    }
+    else if(mid_weight <= weight && weight <= max_weight) {
+        color.r = 1.0;
+        color.g = 1.0 - (weight - mid_weight)/half_range;
+        color.b = 0.0;
+    }
+    else {
+        color.r = 0.0;
+        color.g = 0.0;
+        color.b = 1.0;
     }
-    return color;
 }
 
-void GPF::publish_cloud() {
+void GPF::publish_cloud(const DebugFrame &frame) {
+    if(!frame.cloud) return;
+
     pcl::PointCloud<pcl::PointXYZ> cloud;
-    pcl::transformPointCloud(*_cloud_ptr,
+    pcl::transformPointCloud(*frame.cloud,
                              cloud,
-                             Eigen::Vector3d(_mean_prior[0], _mean_prior[1], _mean_prior[2]),
-                             Eigen::Quaterniond(_mean_prior[3], _mean_prior[4],
-                                                _mean_prior[5], _mean_prior[6]));
+                             Eigen::Vector3d(frame.pose[0], frame.pose[1], frame.pose[2]),
+                             Eigen::Quaterniond(frame.pose[3], frame.pose[4],
+                                                frame.pose[5], frame.pose[6]));
 
     // publish scan
     sensor_msgs::PointCloud2 msg;
     pcl::toROSMsg(cloud, msg);
 
     msg.header.frame_id = "world";
-    msg.header.stamp = _laser_time;
+    msg.header.stamp = frame.stamp;
 
     _cloud_pub.publish(msg);
 }
 
 void GPF::publish_posterior() {
+    if(_post_pub.getNumSubscribers() == 0) return;
     nav_msgs::Odometry msg;
     msg.header.frame_id = "world";
     msg.header.stamp = _laser_time;
@@ -460,33 +1214,17 @@ void GPF::publish_posterior() {
     _post_pub.publish(msg);
 }
 
-void GPF::publish_path() {
-    geometry_msgs::PoseStamped msg;
-
-    msg.header.frame_id = "world";
-    msg.header.stamp = _laser_time;
-
-    msg.pose.position.x = _mean_prior[0];
-    msg.pose.position.y = _mean_prior[1];
-    msg.pose.position.z = _mean_prior[2];
-    msg.pose.orientation.w = _mean_prior[3];
-    msg.pose.orientation.x = _mean_prior[4];
-    msg.pose.orientation.y = _mean_prior[5];
-    msg.pose.orientation.z = _mean_prior[6];
-    
-    _pose_deque.push_back(msg);
-    if(_pose_deque.size() > 400) {
-	    _pose_deque.pop_front();
-    }
-
-    _path.poses.clear();
+void GPF::publish_path(const ros::Time &stamp, const std::vector<geometry_msgs::PoseStamped> &poses) {
     _path.header.frame_id = "world";
-    _path.header.stamp = _laser_time;
-    for(int i=0; i<_pose_deque.size(); i++) {
-    	_path.poses.push_back(_pose_deque[i]);
+    _path.header.stamp = stamp;
+    _path.poses.insert(_path.poses.end(), poses.begin(), poses.end());
+    if(int(_path.poses.size()) > _path_length) {
+        _path.poses.erase(_path.poses.begin(), _path.poses.end() - _path_length);
     }
 
-    _path_pub.publish(_path);
+    if(_path_pub.getNumSubscribers() > 0) {
+        _path_pub.publish(_path);
+    }
 }
 
 void GPF::publish_tf() {
@@ -495,20 +1233,3 @@ void GPF::publish_tf() {
     transform.setRotation(tf::Quaternion(_mean_prior[4], _mean_prior[5], _mean_prior[6], _mean_prior[3]));
     _tf_br.sendTransform(tf::StampedTransform(transform, _laser_time, "world", _robot_frame));
 }
-
-void GPF::publish_pose() {
-    geometry_msgs::PoseStamped msg;
-
-    msg.header.frame_id = "world";
-    msg.header.stamp = _laser_time;
-
-    msg.pose.position.x = _mean_prior[0];
-    msg.pose.position.y = _mean_prior[1];
-    msg.pose.position.z = _mean_prior[2];
-    msg.pose.orientation.w = _mean_prior[3];
-    msg.pose.orientation.x = _mean_prior[4];
-    msg.pose.orientation.y = _mean_prior[5];
-    msg.pose.orientation.z = _mean_prior[6];
-
-    _pose_pub.publish(msg);
-}
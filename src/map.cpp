@@ -12,13 +12,68 @@ DistMap::DistMap(ros::NodeHandle &nh) {
     nh.param("map_file_name", _map_file_name, std::string("nsh_1109.bt"));
     nh.param("octree_resolution", _octree_resolution, 0.05);
     nh.param("max_obstacle_dist", _max_obstacle_dist, 0.5);
+    nh.param("dist_backend", _dist_backend, std::string("edt"));
+    nh.param("dist_layout", _dist_layout, std::string("linear"));
+    nh.param("ray_max_range", _ray_max_range, 15.0);
+    nh.param("map_async_load", _async_load, true);
+    nh.param("map_batch_insert", _batch_insert, true);
+    nh.param("octomap_publish_mode", _publish_mode, std::string("delta"));
+    nh.param("octomap_delta_rate", _delta_rate, 2.0);
+    nh.param("octomap_full_period", _full_period, 30.0);
+
+    _ready = false;
+    _warm_pending = false;
+    _warm_radius = 0.0;
 
     _cloud_sub = nh.subscribe("/map_update", 1, &DistMap::cloud_callback, this);
     _octomap_pub = nh.advertise<octomap_msgs::Octomap>("/octomap", 1);
+    _octomap_delta_pub = nh.advertise<octomap_msgs::Octomap>("/octomap_delta", 10);
+    _octomap_srv = nh.advertiseService("publish_octomap", &DistMap::publish_full_callback, this);
+    if(_publish_mode == "delta") {
+        _publish_timer = nh.createTimer(ros::Duration(1.0 / _delta_rate), &DistMap::publish_timer_callback, this);
+    }
+    _full_dirty = false;
+    _full_requested = false;
+    _last_full_time = ros::WallTime::now();
     _map_ptr = boost::shared_ptr<octomap::OcTree> (new octomap::OcTree (_octree_resolution));
 
+    if(_async_load) {
+        _load_thread = boost::thread(&DistMap::load_map, this);
+    }
+    else {
+        load_map();
+        usleep(100);
+    }
+}
+
+DistMap::~DistMap() {
+    if(_load_thread.joinable()) {
+        _load_thread.join();
+    }
+}
+
+void DistMap::load_map() {
+    ros::WallTime start = ros::WallTime::now();
     read_mapfile();
-    usleep(100);
+
+    // warm ups requested while loading run here, before queries and map
+    // updates are let in, octomap and the field blocks are not thread safe
+    while(true) {
+        octomap::point3d center;
+        double radius;
+        {
+            boost::mutex::scoped_lock lock(_warm_mutex);
+            if(!_warm_pending) {
+                _ready = true;
+                break;
+            }
+            _warm_pending = false;
+            center = _warm_center;
+            radius = _warm_radius;
+        }
+        warm_field(center, radius);
+    }
+    ROS_INFO("DistMap: map ready %0.3f s after start.", (ros::WallTime::now() - start).toSec());
 }
 
 void DistMap::read_mapfile() {
@@ -53,6 +108,10 @@ boost::shared_ptr<octomap::OcTree> DistMap::get_map() const{
     return _dist_map_ptr;
 }
 
+boost::shared_ptr<DistField> DistMap::get_dist_field() const{
+    return _dist_field_ptr;
+}
+
 void DistMap::init_dist_map() {
     double x, y, z;
     _map_ptr->getMetricMin ( x, y, z );
@@ -66,11 +125,28 @@ void DistMap::init_dist_map() {
     max(1) += _max_obstacle_dist;
     max(2) += _max_obstacle_dist;
 
-    _dist_map_ptr = boost::shared_ptr<DynamicEDTOctomap> (
-                      new DynamicEDTOctomap ( float ( _max_obstacle_dist ), & ( *_map_ptr ), min, max, false ) );
-    _dist_map_ptr->update();
+    DistField *field = create_dist_field(_dist_backend);
+    if(!field) {
+        ROS_ERROR("DistMap: unknown distance backend \"%s\".", _dist_backend.c_str());
+        exit(-1);
+    }
+    _dist_field_ptr = boost::shared_ptr<DistField> (field);
+
+    GridField *grid_field = dynamic_cast<GridField*>(field);
+    if(grid_field) {
+        grid_field->set_layout(_dist_layout == "morton" ? LAYOUT_MORTON : LAYOUT_LINEAR);
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    _dist_field_ptr->build(_map_ptr, min, max, _max_obstacle_dist);
+    double build_time = (ros::WallTime::now() - start).toSec();
+
+    EDTField *edt_field = dynamic_cast<EDTField*>(field);
+    _dist_map_ptr = edt_field ? edt_field->get_edt() : boost::shared_ptr<DynamicEDTOctomap>();
 
     ROS_INFO("DistMap: Initialization done.");
+    ROS_INFO("DistMap: %s backend built in %0.3f s, %0.1f MB.", _dist_field_ptr->name().c_str(),
+             build_time, _dist_field_ptr->memory_usage() / 1048576.0);
     ROS_INFO("DistMap: Distance map range:");
     ROS_INFO("         min = [%0.3f %0.3f %0.3f]", min(0), min(1), min(2));
     ROS_INFO("         max = [%0.3f %0.3f %0.3f]", max(0), max(1), max(2));
@@ -79,36 +155,88 @@ void DistMap::init_dist_map() {
 }
 
 double DistMap::ray_casting(octomap::point3d endPt, octomap::point3d originPt, octomap::point3d &rayEndPt) {
-    double dist = 0;
-    octomap::point3d direction;
-    direction = endPt - originPt;
-
-    if(_map_ptr->castRay(originPt, direction, rayEndPt, true, 15.0)) {
-        dist = (rayEndPt - endPt).norm();
+    octomap::point3d direction = endPt - originPt;
+    double norm = direction.norm();
+    if(norm <= 0.0) {
+        return -1.0;
     }
-    else {
-        dist = -1.0;
-        ROS_WARN("DistMap: ray_cast fails");
+    float dx = direction.x() / norm, dy = direction.y() / norm, dz = direction.z() / norm;
+    float range;
+    cast_rays(originPt, &dx, &dy, &dz, 1, _ray_max_range, &range);
+    if(range < 0.0f) {
+        return -1.0;
     }
-    return dist;
+    rayEndPt = originPt + octomap::point3d(dx, dy, dz) * range;
+    return (rayEndPt - endPt).norm();
+}
+
+void DistMap::cast_rays(const octomap::point3d &origin,
+                        const float *dx, const float *dy, const float *dz, int n,
+                        float max_range, float *range) {
+    _dist_field_ptr->cast_rays(origin, dx, dy, dz, n, max_range, _map_ptr->getResolution(), range);
 }
 
 double DistMap::get_dist(octomap::point3d p) {
-    return _dist_map_ptr->getDistance(p);
+    return _dist_field_ptr->get_dist(p);
 }
 char DistMap::get_gridmask(octomap::point3d p) {
-    octomap::OcTreeKey key = _map_ptr->coordToKey(p);
-    octomap::OcTreeNode* node = _map_ptr->search(key);
-    if(!node) {
-        return 2;
-    } else if(_map_ptr->isNodeOccupied(node)) {
-        return 1;
-    } else {
-        return 0;
+    return _dist_field_ptr->get_gridmask(p);
+}
+
+void DistMap::get_dist(const float *x, const float *y, const float *z, int n, float *dist) {
+    if(n <= 0) return;
+    std::vector<char> mask(n);
+    _dist_field_ptr->get_dist(x, y, z, n, dist, &mask[0]);
+}
+
+void DistMap::get_gridmask(const float *x, const float *y, const float *z, int n, char *mask) {
+    if(n <= 0) return;
+    std::vector<float> dist(n);
+    _dist_field_ptr->get_dist(x, y, z, n, &dist[0], mask);
+}
+
+void DistMap::get_log_likelihood(const float *x, const float *y, const float *z, int n,
+                                 double sigma, float *ll) {
+    _dist_field_ptr->get_log_likelihood(x, y, z, n, sigma, ll);
+}
+
+void DistMap::get_dist_grad(const float *x, const float *y, const float *z, int n,
+                            float *dist, float *gx, float *gy, float *gz) {
+    _dist_field_ptr->get_dist_grad(x, y, z, n, _map_ptr->getResolution(), dist, gx, gy, gz);
+}
+
+void DistMap::get_log_likelihood_keys(const int *kx, const int *ky, const int *kz, int n,
+                                      double sigma, float *ll) {
+    _dist_field_ptr->get_log_likelihood_keys(kx, ky, kz, n, sigma, ll);
+}
+
+void DistMap::warm_up(const octomap::point3d &center, double radius) {
+    {
+        boost::mutex::scoped_lock lock(_warm_mutex);
+        if(!_ready) {
+            _warm_pending = true;
+            _warm_center = center;
+            _warm_radius = radius;
+            return;
+        }
     }
+    warm_field(center, radius);
+}
+
+void DistMap::warm_field(const octomap::point3d &center, double radius) {
+    ros::WallTime start = ros::WallTime::now();
+    _dist_field_ptr->warm_up(center, radius);
+    ROS_INFO("DistMap: warm up within %0.1f m of [%0.2f %0.2f %0.2f] took %0.3f s, %0.1f MB.",
+             radius, center.x(), center.y(), center.z(),
+             (ros::WallTime::now() - start).toSec(), _dist_field_ptr->memory_usage() / 1048576.0);
 }
 
 void DistMap::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
+    if(!_ready) {
+        ROS_WARN_THROTTLE(1.0, "DistMap: map is still loading, update dropped.");
+        return;
+    }
+
     octomap::Pointcloud cloud;
     octomap::pointCloud2ToOctomap(msg, cloud);
 
@@ -130,20 +258,197 @@ void DistMap::cloud_callback(const sensor_msgs::PointCloud2 &msg) {
     rotation.setRotation(transform.getRotation());
     double roll, pitch, yaw;
     rotation.getRPY(roll, pitch, yaw);
-    octomap::point3d sensor_origin(0.0,0.0,0.0);
     octomap::pose6d  frame_pose(x, y, z, roll, pitch, yaw);
-    _map_ptr->insertPointCloud(cloud, sensor_origin, frame_pose);
-    _map_ptr->updateInnerOccupancy();
-    _dist_map_ptr->update();
+
+    ros::WallTime start = ros::WallTime::now();
+    cloud.transform(frame_pose);
+    octomap::KeySet free_cells, occupied_cells;
+    if(_batch_insert) {
+        compute_update_keys(cloud, frame_pose.trans(), free_cells, occupied_cells);
+
+        octomap::point3d changed_min, changed_max;
+        if(apply_update_keys(free_cells, occupied_cells, changed_min, changed_max)) {
+            _dist_field_ptr->update_region(changed_min, changed_max);
+        }
+    }
+    else {
+        // as OcTree::insertPointCloud, with the keys kept for the deltas
+        _map_ptr->computeUpdate(cloud, frame_pose.trans(), free_cells, occupied_cells, -1.0);
+        for(octomap::KeySet::const_iterator it = free_cells.begin(); it != free_cells.end(); ++it) {
+            if(occupied_cells.find(*it) == occupied_cells.end()) {
+                _map_ptr->updateNode(*it, false);
+            }
+        }
+        for(octomap::KeySet::const_iterator it = occupied_cells.begin(); it != occupied_cells.end(); ++it) {
+            _map_ptr->updateNode(*it, true);
+        }
+        _map_ptr->updateInnerOccupancy();
+        _dist_field_ptr->update();
+    }
+    if(_publish_mode == "delta" && _octomap_delta_pub.getNumSubscribers() > 0) {
+        _delta_keys.insert(free_cells.begin(), free_cells.end());
+        _delta_keys.insert(occupied_cells.begin(), occupied_cells.end());
+    }
+    double insert_time = (ros::WallTime::now() - start).toSec();
+    ROS_INFO("DistMap: inserted %lu points in %0.3f s, %0.0f points/s.",
+             cloud.size(), insert_time, cloud.size() / std::max(insert_time, 1e-9));
+
+    _full_dirty = true;
+    _last_update_stamp = msg.header.stamp;
+    if(_publish_mode != "delta") {
+        publish_full(msg.header.stamp);
+    }
+    ROS_INFO("DistMap: cloud_callback(): update distance map. map leaf node size %lu", _map_ptr->getNumLeafNodes());
+
+}
+
+void DistMap::publish_timer_callback(const ros::TimerEvent &event) {
+    if(!_ready) {
+        return;
+    }
+    if(!_delta_keys.empty()) {
+        publish_delta(_last_update_stamp);
+    }
+    bool full_due = _full_period > 0.0 && _full_dirty &&
+                    (ros::WallTime::now() - _last_full_time).toSec() >= _full_period;
+    if(_full_requested || full_due) {
+        publish_full(_last_update_stamp.isZero() ? ros::Time::now() : _last_update_stamp);
+    }
+}
+
+bool DistMap::publish_full_callback(std_srvs::Empty::Request &req, std_srvs::Empty::Response &res) {
+    // in delta mode the snapshot goes out with the next timer tick
+    _full_requested = true;
+    if(_publish_mode != "delta" && _ready) {
+        publish_full(ros::Time::now());
+    }
+    return true;
+}
+
+void DistMap::publish_full(const ros::Time &stamp) {
+    _last_full_time = ros::WallTime::now();
+    if(_octomap_pub.getNumSubscribers() == 0) {
+        return;
+    }
 
     octomap_msgs::Octomap octomap_msg;
     octomap_msgs::binaryMapToMsg(*_map_ptr, octomap_msg);
     octomap_msg.header.frame_id = "world";
-    octomap_msg.header.stamp = msg.header.stamp;
+    octomap_msg.header.stamp = stamp;
     octomap_msg.id = 1;
     octomap_msg.binary = 1;
     octomap_msg.resolution = _map_ptr->getResolution();
     _octomap_pub.publish(octomap_msg);
-    ROS_INFO("DistMap: cloud_callback(): update distance map. map leaf node size %lu", _map_ptr->getNumLeafNodes());
 
+    _full_dirty = false;
+    _full_requested = false;
+}
+
+void DistMap::publish_delta(const ros::Time &stamp) {
+    if(_octomap_delta_pub.getNumSubscribers() == 0) {
+        _delta_keys.clear();
+        return;
+    }
+
+    // the changed leafs with their current log odds, free ones included
+    octomap::OcTree delta(_map_ptr->getResolution());
+    for(octomap::KeySet::const_iterator it = _delta_keys.begin(); it != _delta_keys.end(); ++it) {
+        octomap::OcTreeNode *node = _map_ptr->search(*it);
+        if(node) {
+            delta.setNodeValue(*it, node->getLogOdds(), true);
+        }
+    }
+    delta.updateInnerOccupancy();
+
+    octomap_msgs::Octomap octomap_msg;
+    // full serialization, the binary one only keeps occupied and free
+    octomap_msgs::fullMapToMsg(delta, octomap_msg);
+    octomap_msg.header.frame_id = "world";
+    octomap_msg.header.stamp = stamp;
+    _octomap_delta_pub.publish(octomap_msg);
+
+    ROS_DEBUG("DistMap: published %lu changed voxels.", _delta_keys.size());
+    _delta_keys.clear();
+}
+
+void DistMap::compute_update_keys(const octomap::Pointcloud &cloud, const octomap::point3d &origin,
+                                  octomap::KeySet &free_cells, octomap::KeySet &occupied_cells) const {
+    // discretize the end points first, so each hit voxel is ray cast once
+    octomap::OcTreeKey key;
+    for(size_t i=0; i<cloud.size(); i++) {
+        if(_map_ptr->coordToKeyChecked(cloud[i], key)) {
+            occupied_cells.insert(key);
+        }
+    }
+    std::vector<octomap::OcTreeKey> end_keys(occupied_cells.begin(), occupied_cells.end());
+
+#pragma omp parallel
+    {
+        octomap::KeySet local_free;
+        octomap::KeyRay ray;
+#pragma omp for schedule(dynamic, 64) nowait
+        for(int i=0; i<int(end_keys.size()); i++) {
+            if(_map_ptr->computeRayKeys(origin, _map_ptr->keyToCoord(end_keys[i]), ray)) {
+                local_free.insert(ray.begin(), ray.end());
+            }
+        }
+#pragma omp critical
+        free_cells.insert(local_free.begin(), local_free.end());
+    }
+
+    // a voxel hit by any point stays occupied
+    for(octomap::KeySet::const_iterator it = occupied_cells.begin(); it != occupied_cells.end(); ++it) {
+        free_cells.erase(*it);
+    }
+}
+
+bool DistMap::apply_update_keys(const octomap::KeySet &free_cells, const octomap::KeySet &occupied_cells,
+                                octomap::point3d &changed_min, octomap::point3d &changed_max) {
+    std::vector<octomap::OcTreeKey> changed;
+    changed.reserve(free_cells.size() + occupied_cells.size());
+    changed.insert(changed.end(), free_cells.begin(), free_cells.end());
+    changed.insert(changed.end(), occupied_cells.begin(), occupied_cells.end());
+    if(changed.empty()) {
+        return false;
+    }
+
+    // leaf updates only, inner nodes are refreshed below
+    for(size_t i=0; i<free_cells.size() + occupied_cells.size(); i++) {
+        _map_ptr->updateNode(changed[i], i >= free_cells.size(), true);
+    }
+    update_inner_occupancy(changed);
+
+    changed_min = octomap::point3d(1e9, 1e9, 1e9);
+    changed_max = octomap::point3d(-1e9, -1e9, -1e9);
+    for(size_t i=0; i<changed.size(); i++) {
+        octomap::point3d p = _map_ptr->keyToCoord(changed[i]);
+        for(int k=0; k<3; k++) {
+            changed_min(k) = std::min(changed_min(k), p(k));
+            changed_max(k) = std::max(changed_max(k), p(k));
+        }
+    }
+    return true;
+}
+
+void DistMap::update_inner_occupancy(const std::vector<octomap::OcTreeKey> &keys) {
+    // bottom up over the ancestors of the changed leafs only
+    octomap::KeySet parents(keys.begin(), keys.end()), next;
+    // search() treats depth 0 as the full depth, the root comes last
+    for(int depth=int(_map_ptr->getTreeDepth())-1; depth>=1; depth--) {
+        next.clear();
+        for(octomap::KeySet::const_iterator it = parents.begin(); it != parents.end(); ++it) {
+            next.insert(_map_ptr->adjustKeyAtDepth(*it, depth));
+        }
+        for(octomap::KeySet::const_iterator it = next.begin(); it != next.end(); ++it) {
+            octomap::OcTreeNode *node = _map_ptr->search(*it, depth);
+            if(node && node->hasChildren()) {
+                node->updateOccupancyChildren();
+            }
+        }
+        parents.swap(next);
+    }
+    octomap::OcTreeNode *root = _map_ptr->getRoot();
+    if(root && root->hasChildren()) {
+        root->updateOccupancyChildren();
+    }
 }
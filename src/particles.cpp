@@ -7,14 +7,30 @@
 
 #include "lidar_eskf/particles.h"
 
-inline double log_likelihood(double x, double sigma) {
-    return -0.91893853320467274178 - log(sigma) - 0.5 * x * x / (sigma * sigma);
-}
 static EigenMultivariateNormal<double, STATE_SIZE> mvn(Eigen::MatrixXd::Zero(STATE_SIZE,1),
                                                        Eigen::MatrixXd::Identity(STATE_SIZE,STATE_SIZE));
-
-Particles::Particles(boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map_ptr)
+static EigenMultivariateNormal<double, 3> mvn_rotation(Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity());
+static EigenMultivariateNormal<double, 3> mvn_offset(Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity());
+// sobol scrambles and cubature rotations
+static boost::mt19937 qmc_rng;
+static boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> >
+    qmc_normal(qmc_rng, boost::normal_distribution<double>());
+
+Particles::Particles(boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map_ptr), _sobol(STATE_SIZE)
 {
+    _profiling = false;
+    _beam_model = false;
+    _voxel_cache_hits = 0;
+    _voxel_cache_lookups = 0;
+    _min_weight = 0.0;
+    _max_weight = 0.0;
+    _use_proposal = false;
+    _sampling = SAMPLING_RANDOM;
+    _snap_offsets = false;
+    _num_rotations = 1;
+    _num_offsets = 1;
+    _l1_misses = 0;
+    _llc_misses = 0;
     _mean_prior.setZero();
     _mean_posterior.setZero();
     _d_mean_prior.setZero();
@@ -28,6 +44,15 @@ Particles::Particles(boost::shared_ptr<DistMap> map_ptr) : _map_ptr(map_ptr)
 
 void Particles::set_cloud(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr) {
     _cloud_ptr = cloud_ptr;
+
+    _cloud.resize(_cloud_ptr->size());
+    _cloud_range.resize(_cloud_ptr->size());
+    for(size_t i=0; i<_cloud_ptr->size(); i++) {
+        _cloud.x[i] = (*_cloud_ptr)[i].x;
+        _cloud.y[i] = (*_cloud_ptr)[i].y;
+        _cloud.z[i] = (*_cloud_ptr)[i].z;
+        _cloud_range[i] = sqrt(_cloud.x[i]*_cloud.x[i] + _cloud.y[i]*_cloud.y[i] + _cloud.z[i]*_cloud.z[i]);
+    }
 }
 
 void Particles::set_mean(Eigen::Matrix<double, 7, 1> &mean) {
@@ -36,6 +61,7 @@ void Particles::set_mean(Eigen::Matrix<double, 7, 1> &mean) {
 
 void Particles::set_cov(Eigen::Matrix<double, STATE_SIZE, STATE_SIZE> &cov) {
     _d_cov_prior = cov;
+    _use_proposal = false;
 }
 
 void Particles::set_raysigma(double raysigma) {
@@ -49,15 +75,172 @@ void Particles::set_size(int set_size) {
     _d_pset.resize(_set_size);
 }
 
+void Particles::set_profiling(bool profiling) {
+    _profiling = profiling;
+}
+
+void Particles::set_likelihood_model(const std::string &model) {
+    if(model != "field" && model != "beam") {
+        ROS_WARN("Particles: unknown likelihood model \"%s\", using field.", model.c_str());
+    }
+    _beam_model = model == "beam";
+}
+
+void Particles::set_voxel_cache(int bits) {
+    _voxel_cache.reset(bits > 0 ? new VoxelCache(bits) : NULL);
+}
+
+double Particles::prior_distance() {
+    int n = _cloud.size();
+    if(n == 0) return -1.0;
+
+    Particle p;
+    p.translation = _mean_prior.block<3,1>(0,0);
+    p.rotation = Eigen::Quaterniond(_mean_prior[3], _mean_prior[4], _mean_prior[5], _mean_prior[6]);
+    PointBuffer cloud;
+    reproject_cloud(p, cloud);
+    std::vector<float> dist(n);
+    _map_ptr->get_dist(&cloud.x[0], &cloud.y[0], &cloud.z[0], n, &dist[0]);
+
+    double sum = 0.0;
+    int known = 0;
+    for(int i=0; i<n; i++) {
+        if(dist[i] < 0.0f) continue;
+        sum += dist[i];
+        known++;
+    }
+    return known > 0 ? sum / known : -1.0;
+}
+
+bool Particles::refine_proposal(int iterations, double scale) {
+    _use_proposal = false;
+    int n = _cloud.size();
+    if(iterations <= 0 || n == 0) return false;
+
+    Eigen::Quaterniond rotation_prior(_mean_prior[3], _mean_prior[4], _mean_prior[5], _mean_prior[6]);
+    Eigen::Vector3d translation_prior = _mean_prior.block<3,1>(0,0);
+    Eigen::Matrix<double, 6, 6> info_prior = _d_cov_prior.inverse();
+    const double w = 1.0 / (_ray_sigma * _ray_sigma);
+
+    PointBuffer cloud;
+    std::vector<float> dist(n), gx(n), gy(n), gz(n);
+    Eigen::Matrix<double, 6, 1> delta = _d_mean_prior;
+    Eigen::Matrix<double, 6, 6> H;
+    int used = 0;
+    bool converged = false;
+
+    // the last pass only linearizes, so that the proposal covariance
+    // belongs to the final estimate
+    for(int it=0; ; it++) {
+        Particle p;
+        p.translation = translation_prior + delta.block<3,1>(0,0);
+        p.rotation = rotation_prior * Eigen::Quaterniond(angle_axis_to_rotation_matrix(delta.block<3,1>(3,0)));
+        reproject_cloud(p, cloud);
+        _map_ptr->get_dist_grad(&cloud.x[0], &cloud.y[0], &cloud.z[0], n, &dist[0], &gx[0], &gy[0], &gz[0]);
+
+        // maximum a posteriori: prior term plus the squared distances,
+        // J = g^T [I, -R [p]x] for the right perturbation of the rotation
+        Eigen::Matrix3d R = p.rotation.toRotationMatrix();
+        H = info_prior;
+        Eigen::Matrix<double, 6, 1> b = info_prior * (delta - _d_mean_prior);
+        used = 0;
+        for(int i=0; i<n; i++) {
+            Eigen::Vector3d g(gx[i], gy[i], gz[i]);
+            if(dist[i] < 0.0f || g.squaredNorm() < 1e-6) continue;
+            Eigen::Vector3d h = R.transpose() * g;
+            Eigen::Vector3d q(_cloud.x[i], _cloud.y[i], _cloud.z[i]);
+            Eigen::Matrix<double, 6, 1> J;
+            J << g, q.cross(h);
+            H.noalias() += w * J * J.transpose();
+            b.noalias() += w * dist[i] * J;
+            used++;
+        }
+        if(used < 6) return false;
+        if(it == iterations || converged) break;
+
+        Eigen::Matrix<double, 6, 1> step = H.ldlt().solve(b);
+        delta -= step;
+        converged = step.norm() < 1e-4;
+    }
+
+    _d_mean_proposal = delta;
+    _d_cov_proposal = scale * H.inverse();
+    _use_proposal = true;
+    return true;
+}
+
+bool Particles::get_proposal(Eigen::Matrix<double, 6, 1> &mean, Eigen::Matrix<double, 6, 6> &cov) const {
+    if(!_use_proposal) return false;
+    mean = _d_mean_proposal;
+    cov = _d_cov_proposal;
+    return true;
+}
+
+void Particles::set_sampling(const std::string &mode, int rotation_samples, bool snap_offsets) {
+    if(mode == "factorized") {
+        _sampling = SAMPLING_FACTORIZED;
+    } else if(mode == "sobol") {
+        _sampling = SAMPLING_SOBOL;
+    } else if(mode == "cubature") {
+        _sampling = SAMPLING_CUBATURE;
+    } else {
+        if(mode != "random") {
+            ROS_WARN("Particles: unknown sampling mode \"%s\", using random.", mode.c_str());
+        }
+        _sampling = SAMPLING_RANDOM;
+    }
+    _snap_offsets = snap_offsets;
+
+    if(_sampling == SAMPLING_CUBATURE) {
+        int sets = std::max(1, _set_size / (2 * STATE_SIZE));
+        if(sets * 2 * STATE_SIZE != _set_size) {
+            ROS_INFO("Particles: set size %d rounded to %d cubature sets.", _set_size, sets);
+            set_size(sets * 2 * STATE_SIZE);
+        }
+    }
+    if(_sampling != SAMPLING_FACTORIZED) return;
+
+    _num_rotations = std::max(1, std::min(rotation_samples, _set_size));
+    _num_offsets = std::max(1, _set_size / _num_rotations);
+    if(_num_rotations * _num_offsets != _set_size) {
+        ROS_INFO("Particles: set size %d rounded to %d x %d.", _set_size, _num_rotations, _num_offsets);
+        set_size(_num_rotations * _num_offsets);
+    }
+}
+
 void Particles::draw_set() {
 
-    mvn.setMean(_d_mean_prior);
-    mvn.setCovar(_d_cov_prior);
+    if(_sampling == SAMPLING_FACTORIZED) {
+        draw_set_factorized();
+        return;
+    }
+
+    const Eigen::Matrix<double, 6, 1> &mean = _use_proposal ? _d_mean_proposal : _d_mean_prior;
+    const Eigen::Matrix<double, 6, 6> &cov = _use_proposal ? _d_cov_proposal : _d_cov_prior;
+
+    // low discrepancy or cubature points through the Cholesky factor
+    ErrorStates z;
+    Eigen::LLT<Eigen::Matrix<double, 6, 6> > llt(cov);
+    if(_sampling != SAMPLING_RANDOM && llt.info() == Eigen::Success) {
+        if(_sampling == SAMPLING_SOBOL) {
+            draw_normal_sobol(z);
+        } else {
+            draw_normal_cubature(z);
+        }
+    } else {
+        mvn.setMean(mean);
+        mvn.setCovar(cov);
+    }
+    Eigen::Matrix<double, 6, 6> L = llt.matrixL();
 
     for(int i=0; i<_set_size; i++) {
-        // random sample error states
+        // sample error states
         Eigen::Matrix<double, 6, 1> twist;
-        mvn.nextSample(twist);
+        if(z.empty()) {
+            mvn.nextSample(twist);
+        } else {
+            twist = mean + L * z[i];
+        }
         _d_pset[i].translation = twist.block<3,1>(0,0);
         _d_pset[i].angle_axis = twist.block<3,1>(3,0);
 
@@ -88,15 +271,179 @@ void Particles::draw_set() {
     }
 }
 
-void Particles::weight_set() {
-//#pragma omp parallel for
+void Particles::draw_normal_sobol(ErrorStates &z) {
+    z.resize(_set_size);
+    _sobol.reset(boost::uint32_t(qmc_rng()));
+    double u[STATE_SIZE];
+    for(int i=0; i<_set_size; i++) {
+        _sobol.next(u);
+        for(int j=0; j<STATE_SIZE; j++) {
+            z[i][j] = normal_quantile(u[j]);
+        }
+    }
+}
+
+void Particles::draw_normal_cubature(ErrorStates &z) {
+    // +- sqrt(n) along the columns of a random orthogonal matrix
+    const int n = STATE_SIZE;
+    z.resize(_set_size);
+    for(int s=0; s+2*n<=_set_size; s+=2*n) {
+        Eigen::Matrix<double, 6, 6> G;
+        for(int j=0; j<n*n; j++) G(j) = qmc_normal();
+        Eigen::HouseholderQR<Eigen::Matrix<double, 6, 6> > qr(G);
+        Eigen::Matrix<double, 6, 6> Q = qr.householderQ();
+        for(int j=0; j<n; j++) {
+            z[s + 2*j] = sqrt(double(n)) * Q.col(j);
+            z[s + 2*j + 1] = -z[s + 2*j];
+        }
+    }
+}
+
+void Particles::draw_set_factorized() {
+    // t | r is normal with mean A r and covariance S_tt - A S_rt, where
+    // A = S_tr S_rr^-1, so t = A r_k + u_m keeps the joint prior
+    const Eigen::Matrix<double, 6, 1> &mean = _use_proposal ? _d_mean_proposal : _d_mean_prior;
+    const Eigen::Matrix<double, 6, 6> &cov = _use_proposal ? _d_cov_proposal : _d_cov_prior;
+    Eigen::Matrix3d cov_tt = cov.block<3,3>(0,0);
+    Eigen::Matrix3d cov_tr = cov.block<3,3>(0,3);
+    Eigen::Matrix3d cov_rr = cov.block<3,3>(3,3);
+    Eigen::Matrix3d A = cov_rr.ldlt().solve(cov_tr.transpose()).transpose();
+    Eigen::Matrix3d cov_offset = cov_tt - A * cov_tr.transpose();
+    cov_offset = 0.5 * (cov_offset + cov_offset.transpose()) + 1e-12 * Eigen::Matrix3d::Identity();
+
+    mvn_rotation.setMean(mean.block<3,1>(3,0));
+    mvn_rotation.setCovar(cov_rr);
+    mvn_offset.setMean(mean.block<3,1>(0,0));
+    mvn_offset.setCovar(cov_offset);
+
+    Eigen::Quaterniond rotation_prior(_mean_prior[3], _mean_prior[4], _mean_prior[5], _mean_prior[6]);
+    Eigen::Vector3d translation_prior = _mean_prior.block<3,1>(0,0);
+
+    std::vector<Eigen::Vector3d> angle_axis(_num_rotations);
+    _rotation_set.resize(_num_rotations);
+    for(int k=0; k<_num_rotations; k++) {
+        mvn_rotation.nextSample(angle_axis[k]);
+        _rotation_set[k].rotation = rotation_prior *
+            Eigen::Quaterniond(angle_axis_to_rotation_matrix(angle_axis[k]));
+        _rotation_set[k].translation = A * (angle_axis[k] - mean.block<3,1>(3,0));
+    }
+
+    double resolution = _map_ptr->get_map()->getResolution();
+    _offset_set.resize(_num_offsets);
+    _offset_keys.resize(_num_offsets);
+    for(int m=0; m<_num_offsets; m++) {
+        mvn_offset.nextSample(_offset_set[m]);
+        if(_snap_offsets) {
+            for(int j=0; j<3; j++) {
+                _offset_keys[m](j) = int(floor(_offset_set[m](j) / resolution + 0.5));
+                _offset_set[m](j) = _offset_keys[m](j) * resolution;
+            }
+        }
+    }
+
     for(int i=0; i<_set_size; i++) {
-        // reproject cloud on to each particle
-        pcl::PointCloud<pcl::PointXYZ> cloud_transformed;
-//        reproject_cloud(_pset[i], cloud_transformed);
-        pcl::transformPointCloud(*_cloud_ptr, cloud_transformed, _pset[i].translation, _pset[i].rotation);
-        // weight particle
-        weight_particle(_pset[i], cloud_transformed);
+        const Rigid3d &r = _rotation_set[i / _num_offsets];
+        _d_pset[i].translation = r.translation + _offset_set[i % _num_offsets];
+        _d_pset[i].angle_axis = angle_axis[i / _num_offsets];
+        _d_pset[i].weight = log(1.0/_set_size);
+
+        _pset[i].weight = _d_pset[i].weight;
+        _pset[i].translation = translation_prior + _d_pset[i].translation;
+        _pset[i].rotation = r.rotation;
+    }
+
+    // world translation of each rotated cloud, the offsets are added later
+    for(int k=0; k<_num_rotations; k++) {
+        _rotation_set[k].translation += translation_prior;
+    }
+
+    _d_mean_sample.setZero();
+    _d_cov_sample.setZero();
+    for(int i=0; i<_set_size; i++) {
+        _d_mean_sample.block<3,1>(0,0) += _d_pset[i].translation / _set_size;
+        _d_mean_sample.block<3,1>(3,0) += _d_pset[i].angle_axis / _set_size;
+    }
+    for(int i=0; i<_set_size; i++) {
+        Eigen::Matrix<double, 6, 1> twist;
+        twist << _d_pset[i].translation - _d_mean_sample.block<3,1>(0,0),
+                 _d_pset[i].angle_axis - _d_mean_sample.block<3,1>(3,0);
+        _d_cov_sample += twist*twist.transpose() / _set_size;
+    }
+}
+
+void Particles::weight_set() {
+    _l1_misses = 0;
+    _llc_misses = 0;
+    _voxel_cache_hits = 0;
+    _voxel_cache_lookups = 0;
+
+    // the field likelihood only depends on the voxel of an end point
+    bool cached = _voxel_cache && !_beam_model;
+    if(cached) {
+        _voxel_cache->new_scan();
+    }
+
+#pragma omp parallel
+    {
+        PointBuffer cloud_transformed;
+        std::vector<float> weight;
+        CacheScratch scratch;
+        boost::uint64_t hits = 0;
+
+        // factorized sampling: the cloud rotated by the current rotation
+        int rotation = -1;
+        PointBuffer cloud_rotated;
+        KeyBuffer keys_rotated, keys_shifted;
+
+        // hardware counters are per thread
+        boost::scoped_ptr<PerfCounter> l1_counter, llc_counter;
+        if(_profiling) {
+            l1_counter.reset(new PerfCounter(PERF_TYPE_HW_CACHE, PerfCounter::l1d_read_miss()));
+            llc_counter.reset(new PerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES));
+            l1_counter->start();
+            llc_counter->start();
+        }
+
+        // static schedule, so that a thread gets runs of particles sharing
+        // a rotation
+#pragma omp for schedule(static) nowait
+        for(int i=0; i<_set_size; i++) {
+            if(_sampling == SAMPLING_FACTORIZED && !_beam_model) {
+                if(i / _num_offsets != rotation) {
+                    rotation = i / _num_offsets;
+                    rotate_cloud(_rotation_set[rotation], cloud_rotated, keys_rotated);
+                }
+                int m = i % _num_offsets;
+                if(_snap_offsets) {
+                    weight_particle_keys(_pset[i], keys_rotated, _offset_keys[m], keys_shifted, weight);
+                    continue;
+                }
+                shift_cloud(cloud_rotated, _offset_set[m], cloud_transformed);
+            } else {
+                // reproject cloud on to each particle
+                reproject_cloud(_pset[i], cloud_transformed);
+            }
+            // weight particle
+            if(_beam_model) {
+                weight_particle_beam(_pset[i], cloud_transformed, weight);
+            } else if(cached) {
+                weight_particle_cached(_pset[i], cloud_transformed, scratch, hits);
+            } else {
+                weight_particle(_pset[i], cloud_transformed, weight);
+            }
+        }
+
+#pragma omp atomic
+        _voxel_cache_hits += hits;
+
+        if(_profiling) {
+            boost::uint64_t l1_misses = l1_counter->stop();
+            boost::uint64_t llc_misses = llc_counter->stop();
+#pragma omp atomic
+            _l1_misses += l1_misses;
+#pragma omp atomic
+            _llc_misses += llc_misses;
+        }
     }
 
 //    std::cout << "Particles: weight_1 = ";
@@ -105,6 +452,10 @@ void Particles::weight_set() {
 //    }
 //    std::cout << std::endl;
 
+    if(cached) {
+        _voxel_cache_lookups = boost::uint64_t(_set_size) * _cloud.size();
+    }
+
     // stabilize weights, offset weight values to [-200.0, 0.0] range
     double max_weight(-INFINITY);
     for(int i=0; i<_set_size; i++) {
@@ -127,9 +478,13 @@ void Particles::weight_set() {
         weight_sum += exp(_pset[i].weight);
     }
     double log_weight_sum = log(weight_sum);
+    _min_weight = INFINITY;
+    _max_weight = -INFINITY;
     for(int i=0; i<_set_size; i++) {
         _pset[i].weight -= log_weight_sum;
         _d_pset[i].weight = _pset[i].weight;
+        _min_weight = std::min(_min_weight, _pset[i].weight);
+        _max_weight = std::max(_max_weight, _pset[i].weight);
     }
 
 //    std::cout << "Particles: weight_3 = ";
@@ -139,43 +494,163 @@ void Particles::weight_set() {
 //    std::cout << std::endl;
 }
 
-void Particles::reproject_cloud(Particle &p, pcl::PointCloud<pcl::PointXYZ> &cloud) {
+void Particles::reproject_cloud(Particle &p, PointBuffer &cloud) {
+    Eigen::Matrix3f R = p.rotation.toRotationMatrix().cast<float>();
+    Eigen::Vector3f t = p.translation.cast<float>();
+
+    int n = _cloud.size();
+    cloud.resize(n);
+    if(n == 0) return;
+    const float *x = &_cloud.x[0], *y = &_cloud.y[0], *z = &_cloud.z[0];
+    float *tx = &cloud.x[0], *ty = &cloud.y[0], *tz = &cloud.z[0];
+    for(int i=0; i<n; i++) {
+        tx[i] = R(0,0)*x[i] + R(0,1)*y[i] + R(0,2)*z[i] + t(0);
+        ty[i] = R(1,0)*x[i] + R(1,1)*y[i] + R(1,2)*z[i] + t(1);
+        tz[i] = R(2,0)*x[i] + R(2,1)*y[i] + R(2,2)*z[i] + t(2);
+    }
+}
 
-    pcl::transformPointCloud(*_cloud_ptr, cloud, p.translation, p.rotation);
+void Particles::rotate_cloud(const Rigid3d &r, PointBuffer &cloud, KeyBuffer &keys) {
+    Particle p;
+    p.rotation = r.rotation;
+    p.translation = r.translation;
+    reproject_cloud(p, cloud);
+    if(!_snap_offsets) return;
+
+    // octree keys, offsets are added to them per particle
+    const double inv_res = 1.0 / _map_ptr->get_map()->getResolution();
+    int n = cloud.size();
+    keys.resize(n);
+    for(int i=0; i<n; i++) {
+        keys.x[i] = int(floor(cloud.x[i] * inv_res)) + 32768;
+        keys.y[i] = int(floor(cloud.y[i] * inv_res)) + 32768;
+        keys.z[i] = int(floor(cloud.z[i] * inv_res)) + 32768;
+    }
 }
 
-void Particles::weight_particle(Particle &p, pcl::PointCloud<pcl::PointXYZ> &cloud) {
-    std::vector<double> weight;
-    weight.resize(cloud.size());
+void Particles::shift_cloud(const PointBuffer &cloud, const Eigen::Vector3d &offset, PointBuffer &shifted) {
+    int n = cloud.size();
+    shifted.resize(n);
+    const float ox = offset.x(), oy = offset.y(), oz = offset.z();
+    for(int i=0; i<n; i++) {
+        shifted.x[i] = cloud.x[i] + ox;
+        shifted.y[i] = cloud.y[i] + oy;
+        shifted.z[i] = cloud.z[i] + oz;
+    }
+}
 
-//#pragma omp parallel for
-    for(int i=0; i<cloud.size(); i++) {
-        // the end point of one ray
-        octomap::point3d end_pnt(cloud[i].x, cloud[i].y, cloud[i].z);
+void Particles::weight_particle_keys(Particle &p, const KeyBuffer &keys, const Eigen::Vector3i &offset,
+                                     KeyBuffer &shifted, std::vector<float> &weight) {
+    int n = keys.size();
+    if(n == 0) return;
+    shifted.resize(n);
+    weight.resize(n);
+
+    const int ox = offset.x(), oy = offset.y(), oz = offset.z();
+    for(int i=0; i<n; i++) {
+        shifted.x[i] = keys.x[i] + ox;
+        shifted.y[i] = keys.y[i] + oy;
+        shifted.z[i] = keys.z[i] + oz;
+    }
+    _map_ptr->get_log_likelihood_keys(&shifted.x[0], &shifted.y[0], &shifted.z[0], n, _ray_sigma, &weight[0]);
 
-        // look up the distance to nearest obstacle
-        double dist = _map_ptr->get_dist(end_pnt);
+    double sum = 0.0;
+    for(int i=0; i<n; i++) {
+        sum += weight[i];
+    }
+    p.weight += sum;
+}
 
-        // find weight through normal distribution
-        char grid_flag = _map_ptr->get_gridmask(end_pnt);
-        if(grid_flag != 2) {
-            if(dist >= 0.0 && dist <= 2.0*_ray_sigma) {
-                weight[i] = log_likelihood(dist, _ray_sigma);
-            } else {
-                weight[i] = log_likelihood(2.0*_ray_sigma, _ray_sigma);
-            }
+void Particles::weight_particle(Particle &p, PointBuffer &cloud, std::vector<float> &weight) {
+    int n = cloud.size();
+    if(n == 0) return;
+    weight.resize(n);
+
+    // truncated log-likelihood of the distance to the nearest obstacle
+    _map_ptr->get_log_likelihood(&cloud.x[0], &cloud.y[0], &cloud.z[0], n, _ray_sigma, &weight[0]);
+
+    double sum = 0.0;
+    for(int i=0; i<n; i++) {
+        sum += weight[i];
+    }
+    p.weight += sum;
+}
+
+void Particles::weight_particle_cached(Particle &p, PointBuffer &cloud, CacheScratch &scratch,
+                                       boost::uint64_t &hits) {
+    int n = cloud.size();
+    if(n == 0) return;
+
+    // octree keys of the end points, same rounding as OcTree::coordToKey
+    const double inv_res = 1.0 / _map_ptr->get_map()->getResolution();
+    scratch.keys.resize(n);
+    for(int i=0; i<n; i++) {
+        double fx = cloud.x[i] * inv_res, fy = cloud.y[i] * inv_res, fz = cloud.z[i] * inv_res;
+        int kx = int(floor(fx)) + 32768, ky = int(floor(fy)) + 32768, kz = int(floor(fz)) + 32768;
+        bool valid = unsigned(kx) < 65536u && unsigned(ky) < 65536u && unsigned(kz) < 65536u;
+        scratch.keys[i] = valid ? boost::uint64_t(kx) | (boost::uint64_t(ky) << 16) | (boost::uint64_t(kz) << 32)
+                                : VoxelCache::NO_KEY;
+    }
+
+    double sum = 0.0;
+    scratch.miss.clear();
+    for(int i=0; i<n; i++) {
+        float ll;
+        if(_voxel_cache->find(scratch.keys[i], ll)) {
+            sum += ll;
+            hits++;
         } else {
-            if(dist >= 0.0 && dist <= 0.5*_ray_sigma) {
-                weight[i] = log_likelihood(dist, _ray_sigma);
-            } else {
-                weight[i] = log_likelihood(0.5*_ray_sigma, _ray_sigma);
-            }
+            scratch.miss.push_back(i);
         }
     }
 
-    for(int i=0; i<cloud.size(); i++) {
-        p.weight += weight[i];
+    // batched lookup of the misses, then publish them for other particles
+    int m = scratch.miss.size();
+    if(m > 0) {
+        scratch.miss_cloud.resize(m);
+        scratch.miss_ll.resize(m);
+        for(int j=0; j<m; j++) {
+            scratch.miss_cloud.x[j] = cloud.x[scratch.miss[j]];
+            scratch.miss_cloud.y[j] = cloud.y[scratch.miss[j]];
+            scratch.miss_cloud.z[j] = cloud.z[scratch.miss[j]];
+        }
+        _map_ptr->get_log_likelihood(&scratch.miss_cloud.x[0], &scratch.miss_cloud.y[0], &scratch.miss_cloud.z[0],
+                                     m, _ray_sigma, &scratch.miss_ll[0]);
+        for(int j=0; j<m; j++) {
+            sum += scratch.miss_ll[j];
+            _voxel_cache->insert(scratch.keys[scratch.miss[j]], scratch.miss_ll[j]);
+        }
     }
+    p.weight += sum;
+}
+
+void Particles::weight_particle_beam(Particle &p, PointBuffer &cloud, std::vector<float> &weight) {
+    int n = cloud.size();
+    if(n == 0) return;
+    weight.resize(n);
+
+    // the transformed cloud becomes the unit ray directions
+    const float ox = p.translation.x(), oy = p.translation.y(), oz = p.translation.z();
+    for(int i=0; i<n; i++) {
+        float inv = _cloud_range[i] > 0.0f ? 1.0f / _cloud_range[i] : 0.0f;
+        cloud.x[i] = (cloud.x[i] - ox) * inv;
+        cloud.y[i] = (cloud.y[i] - oy) * inv;
+        cloud.z[i] = (cloud.z[i] - oz) * inv;
+    }
+    _map_ptr->cast_rays(octomap::point3d(ox, oy, oz), &cloud.x[0], &cloud.y[0], &cloud.z[0], n,
+                        _map_ptr->get_ray_max_range(), &weight[0]);
+
+    // truncated log-likelihood of the range error, rays that hit nothing
+    // get the truncation value
+    const float c = -0.91893853320467274178 - log(_ray_sigma);
+    const float k = 0.5 / (_ray_sigma * _ray_sigma);
+    const float cap = 2.0 * _ray_sigma;
+    double sum = 0.0;
+    for(int i=0; i<n; i++) {
+        float d = weight[i] >= 0.0f ? std::min(float(fabs(weight[i] - _cloud_range[i])), cap) : cap;
+        sum += c - k * d * d;
+    }
+    p.weight += sum;
 }
 
 void Particles::get_posterior() {
@@ -225,6 +700,22 @@ void Particles::propagate(Eigen::Matrix<double, 6, 1> &mean_prior,
     // generate particles
     draw_set();
 
+    // drawn from the refined proposal: weight by prior over proposal
+    if(_use_proposal) {
+        Eigen::Matrix<double, 6, 6> info_prior = _d_cov_prior.inverse();
+        Eigen::Matrix<double, 6, 6> info_proposal = _d_cov_proposal.inverse();
+        for(int i=0; i<_set_size; i++) {
+            Eigen::Matrix<double, 6, 1> x;
+            x << _d_pset[i].translation, _d_pset[i].angle_axis;
+            Eigen::Matrix<double, 6, 1> e_prior = x - _d_mean_prior;
+            Eigen::Matrix<double, 6, 1> e_proposal = x - _d_mean_proposal;
+            double correction = -0.5 * e_prior.dot(info_prior * e_prior)
+                                + 0.5 * e_proposal.dot(info_proposal * e_proposal);
+            _d_pset[i].weight += correction;
+            _pset[i].weight += correction;
+        }
+    }
+
     // weight each particles
     double start = ros::Time::now().toSec();
     weight_set();
@@ -233,15 +724,24 @@ void Particles::propagate(Eigen::Matrix<double, 6, 1> &mean_prior,
     // compute weighted mean and cov
     get_posterior();
 
-    mean_prior = _d_mean_sample;
-    cov_prior = _d_cov_sample;
+    // the weighted set targets the true prior, which is what the
+    // measurement recovery has to divide out
+    mean_prior = _use_proposal ? _d_mean_prior : _d_mean_sample;
+    cov_prior = _use_proposal ? _d_cov_prior : _d_cov_sample;
     mean_posterior = _d_mean_posterior;
     cov_posterior  = _d_cov_posterior;
 }
-std::vector<Particle> Particles::get_pset() {
-    return _pset;
+void Particles::get_weight_range(double &min_weight, double &max_weight) const {
+    min_weight = _min_weight;
+    max_weight = _max_weight;
+}
+
+void Particles::get_cache_misses(boost::uint64_t &l1_misses, boost::uint64_t &llc_misses) {
+    l1_misses = _l1_misses;
+    llc_misses = _llc_misses;
 }
 
-std::vector<Particle> Particles::get_d_pset() {
-    return _d_pset;
+void Particles::get_voxel_cache_stats(boost::uint64_t &hits, boost::uint64_t &lookups) {
+    hits = _voxel_cache_hits;
+    lookups = _voxel_cache_lookups;
 }
@@ -0,0 +1,95 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include "lidar_eskf/sobol.h"
+#include <algorithm>
+#include <cmath>
+#include <boost/random/mersenne_twister.hpp>
+
+// degree s, coefficients a and initial direction numbers m of the primitive
+// polynomials for dimensions 2 to MAX_DIMS (new-joe-kuo-6.21201)
+static const int POLY_DEGREE[] = {1, 2, 3, 3, 4, 4, 5};
+static const int POLY_COEFF[]  = {0, 1, 1, 2, 1, 4, 2};
+static const int POLY_M[][5]   = {{1}, {1, 3}, {1, 3, 1}, {1, 1, 1},
+                                  {1, 1, 3, 3}, {1, 3, 5, 13}, {1, 1, 5, 5, 17}};
+
+SobolSequence::SobolSequence(int dims) {
+    _dims = std::max(1, std::min(dims, int(MAX_DIMS)));
+
+    // first dimension is the van der Corput sequence in base 2
+    for(int i=0; i<BITS; i++) {
+        _direction[0][i] = boost::uint32_t(1) << (BITS - 1 - i);
+    }
+    for(int d=1; d<_dims; d++) {
+        const int s = POLY_DEGREE[d - 1];
+        const int a = POLY_COEFF[d - 1];
+        boost::uint32_t *v = _direction[d];
+        for(int i=0; i<s; i++) {
+            v[i] = boost::uint32_t(POLY_M[d - 1][i]) << (BITS - 1 - i);
+        }
+        for(int i=s; i<BITS; i++) {
+            v[i] = v[i - s] ^ (v[i - s] >> s);
+            for(int k=1; k<s; k++) {
+                if((a >> (s - 1 - k)) & 1) v[i] ^= v[i - k];
+            }
+        }
+    }
+    reset(0);
+}
+
+void SobolSequence::reset(boost::uint32_t seed) {
+    _index = 0;
+    boost::mt19937 rng(seed);
+    for(int d=0; d<_dims; d++) {
+        _state[d] = 0;
+        _shift[d] = seed ? boost::uint32_t(rng()) : 0;
+    }
+}
+
+void SobolSequence::next(double *u) {
+    // offset by half a unit in the last place, never exactly 0 or 1
+    for(int d=0; d<_dims; d++) {
+        u[d] = (double(_state[d] ^ _shift[d]) + 0.5) / 4294967296.0;
+    }
+
+    // Gray code: flip the direction of the lowest zero bit of the index
+    int c = 0;
+    for(boost::uint32_t i=_index; i & 1; i >>= 1) c++;
+    if(c < BITS) {
+        for(int d=0; d<_dims; d++) _state[d] ^= _direction[d][c];
+    }
+    _index++;
+}
+
+double normal_quantile(double p) {
+    static const double a[] = {-3.969683028665376e+01,  2.209460984245205e+02, -2.759285104469687e+02,
+                                1.383577518672690e+02, -3.066479806614716e+01,  2.506628277459239e+00};
+    static const double b[] = {-5.447609879822406e+01,  1.615858368580409e+02, -1.556989798598866e+02,
+                                6.680131188771972e+01, -1.328068155288572e+01};
+    static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                               -2.549732539343734e+00,  4.374664141464968e+00,  2.938163982698783e+00};
+    static const double d[] = { 7.784695709041462e-03,  3.224671290700398e-01,  2.445134137142996e+00,
+                                3.754408661907416e+00};
+    const double p_low = 0.02425;
+
+    if(p <= 0.0) return -INFINITY;
+    if(p >= 1.0) return INFINITY;
+    if(p < p_low) {
+        double q = sqrt(-2.0 * log(p));
+        return (((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+               ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1.0);
+    }
+    if(p > 1.0 - p_low) {
+        double q = sqrt(-2.0 * log(1.0 - p));
+        return -(((((c[0]*q + c[1])*q + c[2])*q + c[3])*q + c[4])*q + c[5]) /
+                ((((d[0]*q + d[1])*q + d[2])*q + d[3])*q + 1.0);
+    }
+    double q = p - 0.5;
+    double r = q * q;
+    return (((((a[0]*r + a[1])*r + a[2])*r + a[3])*r + a[4])*r + a[5])*q /
+           (((((b[0]*r + b[1])*r + b[2])*r + b[3])*r + b[4])*r + 1.0);
+}
@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include "lidar_eskf/voxel_cache.h"
+
+VoxelCache::VoxelCache(int bits) : _mask((size_t(1) << bits) - 1), _shift(64 - bits), _epoch(0) {
+    _keys.reset(new std::atomic<boost::uint64_t>[_mask + 1]);
+    _values.reset(new std::atomic<float>[_mask + 1]);
+    for(size_t s=0; s<=_mask; s++) {
+        _keys[s].store(0);
+        _values[s].store(std::numeric_limits<float>::quiet_NaN());
+    }
+    new_scan();
+}
+
+void VoxelCache::new_scan() {
+    _epoch += BUSY << 1;
+    if(_epoch == 0) {
+        // the epoch wrapped, old tags could match again
+        for(size_t s=0; s<=_mask; s++) {
+            _keys[s].store(0);
+        }
+        _epoch = BUSY << 1;
+    }
+}
+
+void VoxelCache::insert(boost::uint64_t key, float value) {
+    if(key > KEY_MASK) return;
+    boost::uint64_t tagged = key | _epoch;
+    size_t s = slot(key);
+    for(int p=0; p<MAX_PROBE; p++, s=(s+1)&_mask) {
+        boost::uint64_t k = _keys[s].load(std::memory_order_acquire);
+        while(true) {
+            if(k == tagged) {
+                _values[s].store(value, std::memory_order_relaxed);
+                return;
+            }
+            if(k == (tagged | BUSY)) {
+                // another thread is writing the same voxel
+                return;
+            }
+            if((k & EPOCH_MASK) == _epoch) {
+                // taken by another voxel of this scan
+                break;
+            }
+            // claim a slot of an earlier scan as busy, so that nothing is
+            // written to it before it is ours and readers never see the
+            // old value under the new key; a failed exchange reloads k
+            if(_keys[s].compare_exchange_weak(k, tagged | BUSY, std::memory_order_acquire)) {
+                _values[s].store(value, std::memory_order_relaxed);
+                _keys[s].store(tagged, std::memory_order_release);
+                return;
+            }
+        }
+    }
+}
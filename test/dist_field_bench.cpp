@@ -0,0 +1,411 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include <sstream>
+#include <boost/random.hpp>
+#include <pcl/io/pcd_io.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "lidar_eskf/map.h"
+#include "lidar_eskf/particles.h"
+
+// Compares the distance field backends on the given maps: build time,
+// memory, single and batched query throughput, particle weighting time and
+// localization error of the particle filter. Backends are given as
+// type[:layout], e.g. "dense:morton". The scan is either a recorded cloud
+// in the robot frame (scan_file, taken at scan_pose) or ray cast in the
+// map from its center.
+
+std::vector<std::string> split(const std::string &s) {
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        if(!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+struct QuerySet {
+    std::vector<float> x, y, z;
+};
+
+// half of the queries are spread over the bounding box, the other half
+// land near occupied voxels like the end points of a scan
+void make_queries(const octomap::OcTree &tree, int n, boost::mt19937 &rng, QuerySet &q) {
+    double min_x, min_y, min_z, max_x, max_y, max_z;
+    tree.getMetricMin(min_x, min_y, min_z);
+    tree.getMetricMax(max_x, max_y, max_z);
+
+    std::vector<octomap::point3d> occupied;
+    for(octomap::OcTree::leaf_iterator it = tree.begin_leafs(), end = tree.end_leafs(); it != end; ++it) {
+        if(tree.isNodeOccupied(*it)) occupied.push_back(it.getCoordinate());
+    }
+
+    boost::uniform_real<double> unit(0.0, 1.0);
+    boost::normal_distribution<double> noise(0.0, 0.2);
+    boost::variate_generator<boost::mt19937&, boost::uniform_real<double> > u(rng, unit);
+    boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> > g(rng, noise);
+
+    q.x.resize(n); q.y.resize(n); q.z.resize(n);
+    for(int i=0; i<n; i++) {
+        if(i % 2 == 0 || occupied.empty()) {
+            q.x[i] = min_x + u() * (max_x - min_x);
+            q.y[i] = min_y + u() * (max_y - min_y);
+            q.z[i] = min_z + u() * (max_z - min_z);
+        } else {
+            const octomap::point3d &p = occupied[size_t(u() * occupied.size()) % occupied.size()];
+            q.x[i] = p.x() + g();
+            q.y[i] = p.y() + g();
+            q.z[i] = p.z() + g();
+        }
+    }
+}
+
+// synthetic scan ray cast from the true pose through the distance field,
+// 16 rings between -15 and 15 degrees elevation, in the robot frame.
+// Also times OcTree::castRay on the same rays.
+void make_scan(DistMap &map, const Eigen::Vector3d &t, const Eigen::Quaterniond &q,
+               double range, int num_rays, pcl::PointCloud<pcl::PointXYZ> &cloud) {
+    const int rings = 16;
+    int columns = std::max(1, num_rays / rings);
+    num_rays = rings * columns;
+
+    std::vector<Eigen::Vector3f> dirs(num_rays);
+    std::vector<float> dx(num_rays), dy(num_rays), dz(num_rays), ranges(num_rays);
+    for(int r=0; r<rings; r++) {
+        double elevation = (-15.0 + 30.0 * r / (rings - 1)) * M_PI / 180.0;
+        for(int c=0; c<columns; c++) {
+            double azimuth = 2.0 * M_PI * c / columns;
+            int i = r * columns + c;
+            dirs[i] = Eigen::Vector3f(cos(elevation) * cos(azimuth), cos(elevation) * sin(azimuth), sin(elevation));
+            Eigen::Vector3f d = q.cast<float>() * dirs[i];
+            dx[i] = d.x(); dy[i] = d.y(); dz[i] = d.z();
+        }
+    }
+
+    octomap::point3d origin(t.x(), t.y(), t.z());
+    ros::WallTime start = ros::WallTime::now();
+    map.cast_rays(origin, &dx[0], &dy[0], &dz[0], num_rays, range, &ranges[0]);
+    double field_time = (ros::WallTime::now() - start).toSec() * 1e3;
+
+    int octree_hits = 0;
+    start = ros::WallTime::now();
+    for(int i=0; i<num_rays; i++) {
+        octomap::point3d end;
+        octree_hits += map.get_map()->castRay(origin, octomap::point3d(dx[i], dy[i], dz[i]), end, true, range);
+    }
+    double octree_time = (ros::WallTime::now() - start).toSec() * 1e3;
+
+    cloud.clear();
+    for(int i=0; i<num_rays; i++) {
+        if(ranges[i] < 0.0f) continue;
+        Eigen::Vector3f p = dirs[i] * ranges[i];
+        cloud.push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+    }
+    ROS_INFO("cast %d rays, %lu hits: field %0.1f rays/ms, castRay %0.1f rays/ms (%d hits)",
+             num_rays, cloud.size(), num_rays / field_time, num_rays / octree_time, octree_hits);
+}
+
+int main(int argc, char **argv) {
+    ros::init(argc, argv, "dist_field_bench");
+    ros::NodeHandle n("~");
+
+    std::string map_files, backends, scan_file, scan_pose, threads, likelihood_model;
+    int num_queries, set_size, trials, scan_points, voxel_cache_bits;
+    double ray_sigma, cloud_range;
+    n.param("map_files",   map_files,   std::string("bridge.bt,nsh_1109.bt"));
+    n.param("backends",    backends,    std::string("edt,dense,block,quant8,quant16,lazy"));
+    n.param("num_queries", num_queries, 1000000);
+    n.param("set_size",    set_size,    500);
+    n.param("trials",      trials,      20);
+    n.param("scan_points", scan_points, 2000);
+    n.param("cloud_sigma", ray_sigma,   1.0);
+    n.param("cloud_range", cloud_range, 20.0);
+    n.param("scan_file",   scan_file,   std::string(""));
+    n.param("scan_pose",   scan_pose,   std::string("0,0,0,0,0,0"));
+    n.param("threads",     threads,     std::string("1,2,4,8"));
+    n.param("likelihood_model", likelihood_model, std::string("field"));
+    n.param("voxel_cache_bits", voxel_cache_bits, 18);
+    std::string sampling_mode;
+    int rotation_samples;
+    bool snap_offsets;
+    n.param("sampling_mode", sampling_mode, std::string("random"));
+    n.param("rotation_samples", rotation_samples, 20);
+    n.param("snap_offsets", snap_offsets, true);
+    std::string gn_set_sizes;
+    int gn_iterations;
+    double gn_proposal_scale;
+    n.param("gn_set_sizes", gn_set_sizes, std::string("500,200,100,50"));
+    n.param("gn_iterations", gn_iterations, 5);
+    n.param("gn_proposal_scale", gn_proposal_scale, 2.0);
+    std::string sampling_modes;
+    int reference_size;
+    n.param("sampling_modes", sampling_modes, std::string("random,sobol,cubature"));
+    n.param("reference_size", reference_size, 4000);
+
+    std::vector<std::string> files = split(map_files);
+    std::vector<std::string> types = split(backends);
+
+    for(size_t f=0; f<files.size(); f++) {
+        ROS_INFO("==== %s ====", files[f].c_str());
+        ROS_INFO("%-14s %10s %10s %12s %12s %10s %10s %10s", "backend", "build[s]", "mem[MB]",
+                 "single[M/s]", "batch[M/s]", "weight[ms]", "err_t[m]", "err_r[deg]");
+
+        // the first backend is the reference for the accuracy of the others
+        std::vector<float> ref_dist, ref_ll;
+        std::vector<char> ref_mask;
+
+        for(size_t b=0; b<types.size(); b++) {
+            std::string type = types[b], layout = "linear";
+            if(type.find(':') != std::string::npos) {
+                layout = type.substr(type.find(':') + 1);
+                type = type.substr(0, type.find(':'));
+            }
+            n.setParam("map_file_name", files[f]);
+            n.setParam("dist_backend", type);
+            n.setParam("dist_layout", layout);
+            n.setParam("map_async_load", false);
+            boost::shared_ptr<DistMap> map_ptr(new DistMap(n));
+            boost::shared_ptr<octomap::OcTree> tree_ptr = map_ptr->get_map();
+
+            // build time
+            ros::WallTime start = ros::WallTime::now();
+            map_ptr->init_dist_map();
+            double build_time = (ros::WallTime::now() - start).toSec();
+            boost::shared_ptr<DistField> field_ptr = map_ptr->get_dist_field();
+
+#ifdef _OPENMP
+            // build time against thread count, the edt backend is single threaded
+            if(type != "edt") {
+                std::vector<std::string> counts = split(threads);
+                int max_threads = omp_get_max_threads();
+                for(size_t k=0; k<counts.size(); k++) {
+                    omp_set_num_threads(atoi(counts[k].c_str()));
+                    start = ros::WallTime::now();
+                    map_ptr->init_dist_map();
+                    ROS_INFO("%-14s build with %2d threads: %0.3f s", types[b].c_str(),
+                             atoi(counts[k].c_str()), (ros::WallTime::now() - start).toSec());
+                }
+                omp_set_num_threads(max_threads);
+                field_ptr = map_ptr->get_dist_field();
+            }
+#endif
+
+            // query throughput, same queries for every backend
+            boost::mt19937 rng(42);
+            QuerySet q;
+            make_queries(*tree_ptr, num_queries, rng, q);
+
+            double sum = 0.0;
+            start = ros::WallTime::now();
+            for(int i=0; i<num_queries; i++) {
+                octomap::point3d p(q.x[i], q.y[i], q.z[i]);
+                sum += map_ptr->get_dist(p) + map_ptr->get_gridmask(p);
+            }
+            double single_rate = num_queries / (ros::WallTime::now() - start).toSec() * 1e-6;
+
+            std::vector<float> dist(num_queries);
+            std::vector<char> mask(num_queries);
+            start = ros::WallTime::now();
+            field_ptr->get_dist(&q.x[0], &q.y[0], &q.z[0], num_queries, &dist[0], &mask[0]);
+            double batch_rate = num_queries / (ros::WallTime::now() - start).toSec() * 1e-6;
+            for(int i=0; i<num_queries; i++) sum -= dist[i] + mask[i];
+            if(fabs(sum) > 1e-3 * num_queries) {
+                ROS_WARN("%s: batched and single queries disagree (%f)", types[b].c_str(), sum);
+            }
+
+            // accuracy against the reference backend
+            std::vector<float> ll(num_queries);
+            field_ptr->get_log_likelihood(&q.x[0], &q.y[0], &q.z[0], num_queries, ray_sigma, &ll[0]);
+            if(b == 0) {
+                ref_dist = dist;
+                ref_mask = mask;
+                ref_ll = ll;
+            } else {
+                double max_dd = 0.0, mean_dd = 0.0, max_dll = 0.0;
+                int mask_err = 0;
+                for(int i=0; i<num_queries; i++) {
+                    double dd = fabs(dist[i] - ref_dist[i]);
+                    max_dd = std::max(max_dd, dd);
+                    mean_dd += dd / num_queries;
+                    max_dll = std::max(max_dll, double(fabs(ll[i] - ref_ll[i])));
+                    if(mask[i] != ref_mask[i]) mask_err++;
+                }
+                ROS_INFO("%-14s vs %s: max |dd| %0.2f mm, mean |dd| %0.3f mm, max |dll| %0.5f, mask errors %d",
+                         types[b].c_str(), types[0].c_str(), max_dd * 1e3, mean_dd * 1e3, max_dll, mask_err);
+            }
+
+            // localization error from perturbed priors around the scan pose
+            Eigen::Vector3d t_true;
+            Eigen::Quaterniond q_true;
+            pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr(new pcl::PointCloud<pcl::PointXYZ>);
+            if(!scan_file.empty() && pcl::io::loadPCDFile(scan_file, *cloud_ptr) == 0) {
+                double v[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+                std::vector<std::string> pose = split(scan_pose);
+                for(size_t k=0; k<pose.size() && k<6; k++) v[k] = atof(pose[k].c_str());
+                t_true = Eigen::Vector3d(v[0], v[1], v[2]);
+                q_true = Eigen::Quaterniond(euler_angle_to_rotation_matrix(Eigen::Vector3d(v[3], v[4], v[5])));
+            } else {
+                double min_x, min_y, min_z, max_x, max_y, max_z;
+                tree_ptr->getMetricMin(min_x, min_y, min_z);
+                tree_ptr->getMetricMax(max_x, max_y, max_z);
+                t_true = Eigen::Vector3d(0.5*(min_x+max_x), 0.5*(min_y+max_y), 0.5*(min_z+max_z));
+                q_true = Eigen::Quaterniond::Identity();
+                make_scan(*map_ptr, t_true, q_true, cloud_range, scan_points, *cloud_ptr);
+            }
+
+            // the lazy backend only pays for the blocks around the scan
+            if(type == "lazy") {
+                field_ptr->update();
+                start = ros::WallTime::now();
+                map_ptr->warm_up(octomap::point3d(t_true.x(), t_true.y(), t_true.z()), cloud_range);
+                ROS_INFO("%-14s warm up within %0.1f m: %0.3f s, %0.1f MB", types[b].c_str(), cloud_range,
+                         (ros::WallTime::now() - start).toSec(), field_ptr->memory_usage() / 1048576.0);
+            }
+
+            Particles particles(map_ptr);
+            particles.set_raysigma(ray_sigma);
+            particles.set_size(set_size);
+            particles.set_likelihood_model(likelihood_model);
+            particles.set_sampling(sampling_mode, rotation_samples, snap_offsets);
+            particles.set_cloud(cloud_ptr);
+
+            Eigen::Matrix<double, 6, 1> sigma;
+            sigma << 0.04, 0.04, 0.04, 0.0025, 0.0025, 0.0025;
+            Eigen::Matrix<double, 6, 6> cov_prior = sigma.asDiagonal();
+            EigenMultivariateNormal<double, STATE_SIZE> perturb(Eigen::MatrixXd::Zero(STATE_SIZE,1), cov_prior);
+
+            double err_t = 0.0, err_r = 0.0, weight_time = 0.0;
+            std::vector<Eigen::Matrix<double, 7, 1> > priors;
+            ErrorStates truths;
+            for(int k=0; k<trials; k++) {
+                Eigen::Matrix<double, 6, 1> d;
+                perturb.nextSample(d);
+                Eigen::Vector3d t_prior = t_true - d.block<3,1>(0,0);
+                Eigen::Quaterniond q_prior = q_true *
+                    Eigen::Quaterniond(angle_axis_to_rotation_matrix(d.block<3,1>(3,0))).inverse();
+
+                Eigen::Matrix<double, 7, 1> mean;
+                mean << t_prior, q_prior.w(), q_prior.x(), q_prior.y(), q_prior.z();
+                priors.push_back(mean);
+                truths.push_back(d);
+                particles.set_mean(mean);
+                particles.set_cov(cov_prior);
+
+                Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+                Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+                start = ros::WallTime::now();
+                particles.propagate(mean_sample, cov_sample, mean_posterior, cov_posterior);
+                weight_time += (ros::WallTime::now() - start).toSec() * 1e3 / trials;
+
+                err_t += (mean_posterior.block<3,1>(0,0) - d.block<3,1>(0,0)).norm() / trials;
+                err_r += (mean_posterior.block<3,1>(3,0) - d.block<3,1>(3,0)).norm() * 180.0 / M_PI / trials;
+            }
+
+            ROS_INFO("%-14s %10.3f %10.1f %12.2f %12.2f %10.2f %10.3f %10.3f", types[b].c_str(), build_time,
+                     field_ptr->memory_usage() / 1048576.0, single_rate, batch_rate, weight_time, err_t, err_r);
+
+            // same priors again, sharing end point likelihoods between particles
+            if(voxel_cache_bits > 0 && likelihood_model == "field") {
+                particles.set_voxel_cache(voxel_cache_bits);
+                double cached_time = 0.0;
+                boost::uint64_t hits = 0, lookups = 0;
+                for(int k=0; k<trials; k++) {
+                    particles.set_mean(priors[k]);
+                    particles.set_cov(cov_prior);
+
+                    Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+                    Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+                    start = ros::WallTime::now();
+                    particles.propagate(mean_sample, cov_sample, mean_posterior, cov_posterior);
+                    cached_time += (ros::WallTime::now() - start).toSec() * 1e3 / trials;
+
+                    boost::uint64_t h, l;
+                    particles.get_voxel_cache_stats(h, l);
+                    hits += h;
+                    lookups += l;
+                }
+                ROS_INFO("%-14s voxel cache: hit rate %0.1f%%, weight %0.2f ms, speedup %0.2fx", types[b].c_str(),
+                         lookups ? 100.0 * hits / lookups : 0.0, cached_time, weight_time / cached_time);
+                particles.set_voxel_cache(0);
+            }
+
+            // particles vs error vs time, sampling from the prior or from the
+            // gauss-newton refined proposal
+            std::vector<std::string> sizes = split(gn_set_sizes);
+            for(size_t m=0; m<sizes.size() && gn_iterations > 0; m++) {
+                particles.set_size(atoi(sizes[m].c_str()));
+                particles.set_sampling(sampling_mode, rotation_samples, snap_offsets);
+                for(int gn=0; gn<2; gn++) {
+                    double time = 0.0, gn_err_t = 0.0, gn_err_r = 0.0;
+                    int failed = 0;
+                    for(int k=0; k<trials; k++) {
+                        particles.set_mean(priors[k]);
+                        particles.set_cov(cov_prior);
+
+                        Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+                        Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+                        start = ros::WallTime::now();
+                        if(gn && !particles.refine_proposal(gn_iterations, gn_proposal_scale)) failed++;
+                        particles.propagate(mean_sample, cov_sample, mean_posterior, cov_posterior);
+                        time += (ros::WallTime::now() - start).toSec() * 1e3 / trials;
+
+                        gn_err_t += (mean_posterior.block<3,1>(0,0) - truths[k].block<3,1>(0,0)).norm() / trials;
+                        gn_err_r += (mean_posterior.block<3,1>(3,0) - truths[k].block<3,1>(3,0)).norm() * 180.0 / M_PI / trials;
+                    }
+                    ROS_INFO("%-14s %s %5d particles: %8.2f ms, err_t %0.3f m, err_r %0.3f deg, %d fallbacks",
+                             types[b].c_str(), gn ? "gauss-newton" : "prior       ", int(particles.get_pset().size()),
+                             time, gn_err_t, gn_err_r, failed);
+                }
+            }
+
+            // convergence of the posterior mean: deviation from a large
+            // random set on the same priors
+            std::vector<std::string> modes = split(sampling_modes);
+            if(reference_size > 0 && !modes.empty()) {
+                particles.set_size(reference_size);
+                particles.set_sampling("random", rotation_samples, snap_offsets);
+                ErrorStates references;
+                for(int k=0; k<trials; k++) {
+                    particles.set_mean(priors[k]);
+                    particles.set_cov(cov_prior);
+                    Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+                    Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+                    particles.propagate(mean_sample, cov_sample, mean_posterior, cov_posterior);
+                    references.push_back(mean_posterior);
+                }
+
+                for(size_t m=0; m<sizes.size(); m++) {
+                    for(size_t s=0; s<modes.size(); s++) {
+                        particles.set_size(atoi(sizes[m].c_str()));
+                        particles.set_sampling(modes[s], rotation_samples, snap_offsets);
+                        double time = 0.0, dev_t = 0.0, dev_r = 0.0;
+                        for(int k=0; k<trials; k++) {
+                            particles.set_mean(priors[k]);
+                            particles.set_cov(cov_prior);
+                            Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+                            Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+                            start = ros::WallTime::now();
+                            particles.propagate(mean_sample, cov_sample, mean_posterior, cov_posterior);
+                            time += (ros::WallTime::now() - start).toSec() * 1e3 / trials;
+
+                            Eigen::Matrix<double, 6, 1> dev = mean_posterior - references[k];
+                            dev_t += dev.block<3,1>(0,0).norm() / trials;
+                            dev_r += dev.block<3,1>(3,0).norm() * 180.0 / M_PI / trials;
+                        }
+                        ROS_INFO("%-14s %-10s %5d particles: %8.2f ms, dev_t %0.4f m, dev_r %0.4f deg",
+                                 types[b].c_str(), modes[s].c_str(), int(particles.get_pset().size()),
+                                 time, dev_t, dev_r);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <limits>
+#include <boost/scoped_ptr.hpp>
+#include "lidar_eskf/edt.h"
+#include "lidar_eskf/dist_field.h"
+
+// squared distance in cells from every cell to the closest occupied one,
+// by looking at all pairs
+static void brute_force_edt(const std::vector<char> &occupied,
+                            int sx, int sy, int sz, float max_sq_dist,
+                            std::vector<float> &sq_dist) {
+    const float inf = std::numeric_limits<float>::infinity();
+    sq_dist.assign(occupied.size(), inf);
+    for(int z=0; z<sz; z++) {
+        for(int y=0; y<sy; y++) {
+            for(int x=0; x<sx; x++) {
+                float best = inf;
+                for(int oz=0; oz<sz; oz++) {
+                    for(int oy=0; oy<sy; oy++) {
+                        for(int ox=0; ox<sx; ox++) {
+                            if(!occupied[(oz*sy + oy)*sx + ox]) continue;
+                            float d2 = float((x-ox)*(x-ox) + (y-oy)*(y-oy) + (z-oz)*(z-oz));
+                            best = std::min(best, d2);
+                        }
+                    }
+                }
+                sq_dist[(z*sy + y)*sx + x] = best <= max_sq_dist ? best : inf;
+            }
+        }
+    }
+}
+
+static void check_edt(int sx, int sy, int sz, double fill, float max_sq_dist, unsigned seed) {
+    srand(seed);
+    std::vector<char> occupied(sx*sy*sz);
+    for(size_t i=0; i<occupied.size(); i++) {
+        occupied[i] = rand() < fill * RAND_MAX;
+    }
+
+    std::vector<float> expected, actual;
+    brute_force_edt(occupied, sx, sy, sz, max_sq_dist, expected);
+    squared_edt(occupied, sx, sy, sz, max_sq_dist, actual);
+
+    ASSERT_EQ(expected.size(), actual.size());
+    for(size_t i=0; i<expected.size(); i++) {
+        ASSERT_EQ(expected[i], actual[i]) << "cell " << i << " of " << sx << "x" << sy << "x" << sz
+                                          << " fill " << fill << " band " << max_sq_dist;
+    }
+}
+
+TEST(SquaredEDT, MatchesBruteForce) {
+    const float no_band = std::numeric_limits<float>::max();
+    unsigned seed = 1;
+    check_edt(1, 1, 1, 0.5, no_band, seed++);
+    check_edt(7, 1, 1, 0.2, no_band, seed++);
+    check_edt(1, 9, 1, 0.2, no_band, seed++);
+    check_edt(1, 1, 11, 0.2, no_band, seed++);
+    for(int i=0; i<20; i++) {
+        int sx = 1 + rand() % 13, sy = 1 + rand() % 11, sz = 1 + rand() % 9;
+        double fill = i % 4 == 0 ? 0.002 : 0.05 * (1 + i % 4);
+        check_edt(sx, sy, sz, fill, no_band, seed++);
+    }
+}
+
+TEST(SquaredEDT, MatchesBruteForceInBand) {
+    unsigned seed = 100;
+    for(int i=0; i<20; i++) {
+        int sx = 1 + rand() % 13, sy = 1 + rand() % 11, sz = 1 + rand() % 9;
+        check_edt(sx, sy, sz, 0.03, float(i % 10), seed++);
+    }
+}
+
+TEST(SquaredEDT, EmptyGrid) {
+    std::vector<char> occupied(5*4*3, 0);
+    std::vector<float> sq_dist;
+    squared_edt(occupied, 5, 4, 3, 100.0f, sq_dist);
+    for(size_t i=0; i<sq_dist.size(); i++) {
+        EXPECT_EQ(std::numeric_limits<float>::infinity(), sq_dist[i]);
+    }
+}
+
+// The grid backends must answer like DynamicEDTOctomap inside the
+// saturation band, and agree on the grid mask everywhere.
+TEST(DistField, BackendsMatchEDT) {
+    const double res = 0.1;
+    const double max_dist = 0.5;
+    boost::shared_ptr<octomap::OcTree> tree(new octomap::OcTree(res));
+    srand(7);
+    for(int i=0; i<400; i++) {
+        octomap::point3d p(3.0 * rand() / RAND_MAX, 3.0 * rand() / RAND_MAX, 2.0 * rand() / RAND_MAX);
+        tree->updateNode(p, i % 3 != 0);
+    }
+    tree->updateInnerOccupancy();
+
+    octomap::point3d min(-0.5, -0.5, -0.5), max(3.5, 3.5, 2.5);
+
+    // voxel centers over the whole box, so that no query sits on a voxel border
+    std::vector<float> x, y, z;
+    octomap::OcTreeKey kmin = tree->coordToKey(min), kmax = tree->coordToKey(max);
+    for(int kz=kmin[2]; kz<=kmax[2]; kz++) {
+        for(int ky=kmin[1]; ky<=kmax[1]; ky++) {
+            for(int kx=kmin[0]; kx<=kmax[0]; kx++) {
+                octomap::point3d c = tree->keyToCoord(octomap::OcTreeKey(kx, ky, kz));
+                x.push_back(c.x());
+                y.push_back(c.y());
+                z.push_back(c.z());
+            }
+        }
+    }
+    const int n = x.size();
+
+    EDTField edt;
+    edt.build(tree, min, max, max_dist);
+    std::vector<float> ref(n);
+    std::vector<char> ref_mask(n);
+    edt.get_dist(&x[0], &y[0], &z[0], n, &ref[0], &ref_mask[0]);
+
+    // distance reached by every backend past the band
+    const int max_sq_dist = int(float(max_dist) / float(res) * float(max_dist) / float(res));
+    const float sat_dist = float(sqrt(double(max_sq_dist)) * res);
+
+    const char *types[] = {"dense", "quant16", "lazy"};
+    for(int t=0; t<3; t++) {
+        boost::scoped_ptr<DistField> field(create_dist_field(types[t]));
+        ASSERT_TRUE(field.get() != NULL);
+        field->build(tree, min, max, max_dist);
+
+        // quant16 rounds to its step, the others store the float distance
+        float tol = t == 1 ? float(0.5 * max_dist / QuantField<boost::uint16_t>::DIST_MASK) + 1e-4f : 1e-4f;
+
+        std::vector<float> dist(n);
+        std::vector<char> mask(n);
+        field->get_dist(&x[0], &y[0], &z[0], n, &dist[0], &mask[0]);
+
+        int compared = 0;
+        for(int i=0; i<n; i++) {
+            ASSERT_EQ(ref_mask[i], mask[i]) << types[t] << " at " << x[i] << " " << y[i] << " " << z[i];
+            if(ref[i] < 0.0f) {
+                EXPECT_EQ(ref[i], dist[i]) << types[t];
+            } else if(ref[i] < sat_dist - tol) {
+                EXPECT_NEAR(ref[i], dist[i], tol) << types[t] << " at " << x[i] << " " << y[i] << " " << z[i];
+                compared++;
+            } else {
+                EXPECT_GE(dist[i], sat_dist - tol) << types[t] << " at " << x[i] << " " << y[i] << " " << z[i];
+            }
+        }
+        EXPECT_GT(compared, n / 10) << types[t];
+    }
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
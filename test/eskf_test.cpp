@@ -78,6 +78,174 @@ void publish_fake_measure(const ros::TimerEvent&) {
     fake_meas_pub.publish(msg);
 }
 
+#ifdef ESKF_UNIT_TEST
+#include <gtest/gtest.h>
+#include "lidar_eskf/gpf.h"
+
+// random symmetric positive definite matrix with eigenvalues in [lo, hi]
+template<int N>
+static Eigen::Matrix<double, N, N> random_spd(double lo, double hi) {
+    Eigen::Matrix<double, N, N> A = Eigen::Matrix<double, N, N>::Random();
+    Eigen::HouseholderQR<Eigen::Matrix<double, N, N> > qr(A);
+    Eigen::Matrix<double, N, N> Q = qr.householderQ();
+    Eigen::Matrix<double, N, 1> e = Eigen::Matrix<double, N, 1>::Random();
+    e = (lo + 0.5 * (hi - lo)) * Eigen::Matrix<double, N, 1>::Ones() + 0.5 * (hi - lo) * e;
+    return Q * e.asDiagonal() * Q.transpose();
+}
+
+static Eigen::Matrix<double, 6, 15> pose_selection() {
+    Eigen::Matrix<double, 6, 15> H;
+    H.setZero();
+    H.block<6,6>(0,3).setIdentity();
+    return H;
+}
+
+// measurement recovery before the information form
+static void recover_meas_old(const Eigen::Matrix<double, 6, 1> &mean_sample,
+                             const Eigen::Matrix<double, 6, 6> &cov_sample,
+                             const Eigen::Matrix<double, 6, 1> &mean_posterior,
+                             const Eigen::Matrix<double, 6, 6> &cov_posterior,
+                             Eigen::Matrix<double, 6, 1> &mean_meas,
+                             Eigen::Matrix<double, 6, 6> &cov_meas) {
+    cov_meas = (cov_posterior.inverse() - cov_sample.inverse()).inverse();
+
+    // check_posdef
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 6, 6> > solver(cov_meas);
+    Eigen::Matrix<double, 6, 6> rot = solver.eigenvectors();
+    Eigen::Matrix<double, 6, 1> scl = solver.eigenvalues();
+    Eigen::Matrix<double, 6, 6> E;
+    E.setZero();
+    for(int i=0; i<6; i++) {
+        E(i,i) = scl[i] > 0.0 ? scl[i] : 100.0;
+    }
+    cov_meas = rot * E * rot.inverse();
+
+    Eigen::Matrix<double, 6, 6> K = cov_sample * (cov_sample + cov_meas).inverse();
+    mean_meas = K.inverse() * (mean_posterior - mean_sample) + mean_sample;
+}
+
+// ESKF::update_error() before the information form
+static Eigen::Matrix<double, 15, 1> update_error_old(const Eigen::Matrix<double, 6, 1> &y,
+                                                     const Eigen::Matrix<double, 6, 6> &R,
+                                                     Eigen::Matrix<double, 15, 15> &Sigma) {
+    Eigen::Matrix<double, 6, 15> H = pose_selection();
+    Eigen::Matrix<double, 15, 6> K;
+    K = Sigma * H.transpose() * (H * Sigma * H.transpose() + R).inverse();
+    Eigen::Matrix<double, 15, 15> M = Eigen::Matrix<double, 15, 15>::Identity() - K * H;
+    Sigma = M * Sigma;
+    return K * y;
+}
+
+// sample and posterior moments of the pose for a measurement y with
+// information matrix info
+static void make_moments(const Eigen::Matrix<double, 15, 15> &Sigma,
+                         const Eigen::Matrix<double, 6, 1> &y,
+                         const Eigen::Matrix<double, 6, 6> &info,
+                         Eigen::Matrix<double, 6, 1> &mean_sample,
+                         Eigen::Matrix<double, 6, 6> &cov_sample,
+                         Eigen::Matrix<double, 6, 1> &mean_posterior,
+                         Eigen::Matrix<double, 6, 6> &cov_posterior) {
+    Eigen::Matrix<double, 6, 15> H = pose_selection();
+    mean_sample = 0.01 * Eigen::Matrix<double, 6, 1>::Random();
+    cov_sample = H * Sigma * H.transpose();
+    cov_posterior = (cov_sample.inverse() + info).inverse();
+    mean_posterior = cov_posterior * (cov_sample.inverse() * mean_sample + info * y);
+}
+
+TEST(PoseUpdate, InfoFormMatchesCovarianceForm) {
+    srand(3);
+    for(int trial=0; trial<50; trial++) {
+        Eigen::Matrix<double, 15, 15> Sigma = random_spd<15>(0.01, 1.0);
+        Eigen::Matrix<double, 6, 6> R = random_spd<6>(0.01, 1.0);
+        Eigen::Matrix<double, 6, 1> y = 0.2 * Eigen::Matrix<double, 6, 1>::Random();
+
+        Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+        Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+        make_moments(Sigma, y, R.inverse(), mean_sample, cov_sample, mean_posterior, cov_posterior);
+
+        Eigen::Matrix<double, 6, 1> old_mean;
+        Eigen::Matrix<double, 6, 6> old_cov;
+        recover_meas_old(mean_sample, cov_sample, mean_posterior, cov_posterior, old_mean, old_cov);
+        Eigen::Matrix<double, 15, 15> old_Sigma = Sigma;
+        Eigen::Matrix<double, 15, 1> old_x = update_error_old(old_mean, old_cov, old_Sigma);
+
+        Eigen::Matrix<double, 6, 6> W, cov_meas;
+        Eigen::Matrix<double, 6, 1> z, mean_meas;
+        ASSERT_TRUE(recover_pose_meas(mean_sample, cov_sample, mean_posterior, cov_posterior,
+                                      W, z, mean_meas, cov_meas));
+        EXPECT_LT((mean_meas - old_mean).norm(), 1e-8);
+        EXPECT_LT((cov_meas - old_cov).norm(), 1e-8);
+
+        Eigen::Matrix<double, 15, 15> info_Sigma = Sigma;
+        Eigen::Matrix<double, 15, 1> info_x = update_pose_info(W, z, info_Sigma);
+        EXPECT_LT((info_x - old_x).norm(), 1e-8) << "trial " << trial;
+        EXPECT_LT((info_Sigma - old_Sigma).norm(), 1e-8) << "trial " << trial;
+
+        Eigen::Matrix<double, 15, 15> cov_Sigma = Sigma;
+        Eigen::Matrix<double, 15, 1> cov_x = update_pose_cov(old_mean, old_cov, cov_Sigma);
+        EXPECT_LT((cov_x - old_x).norm(), 1e-8) << "trial " << trial;
+        EXPECT_LT((cov_Sigma - old_Sigma).norm(), 1e-8) << "trial " << trial;
+    }
+}
+
+// a scan that constrains only four of the six directions, like a corridor
+TEST(PoseUpdate, RankDeficientDropsDirections) {
+    srand(4);
+    for(int trial=0; trial<50; trial++) {
+        Eigen::Matrix<double, 15, 15> Sigma = random_spd<15>(0.01, 1.0);
+        Eigen::Matrix<double, 6, 4> B = 3.0 * Eigen::Matrix<double, 6, 4>::Random();
+        Eigen::Matrix<double, 6, 6> info = B * B.transpose();
+        Eigen::Matrix<double, 6, 1> y = 0.2 * Eigen::Matrix<double, 6, 1>::Random();
+
+        Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+        Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+        make_moments(Sigma, y, info, mean_sample, cov_sample, mean_posterior, cov_posterior);
+
+        Eigen::Matrix<double, 6, 6> W, cov_meas;
+        Eigen::Matrix<double, 6, 1> z, mean_meas;
+        ASSERT_TRUE(recover_pose_meas(mean_sample, cov_sample, mean_posterior, cov_posterior,
+                                      W, z, mean_meas, cov_meas));
+        int dropped = 0;
+        for(int i=0; i<6; i++) {
+            if(W.col(i).isZero(0.0)) {
+                EXPECT_EQ(0.0, z[i]);
+                dropped++;
+            }
+        }
+        EXPECT_EQ(2, dropped) << "trial " << trial;
+        EXPECT_LT((W * W.transpose() - info).norm(), 1e-6 * info.norm()) << "trial " << trial;
+
+        // information filter update with the exact measurement
+        Eigen::Matrix<double, 6, 15> H = pose_selection();
+        Eigen::Matrix<double, 15, 15> ref_Sigma = (Sigma.inverse() + H.transpose() * info * H).inverse();
+        Eigen::Matrix<double, 15, 1> ref_x = ref_Sigma * H.transpose() * info * y;
+
+        Eigen::Matrix<double, 15, 15> info_Sigma = Sigma;
+        Eigen::Matrix<double, 15, 1> info_x = update_pose_info(W, z, info_Sigma);
+        EXPECT_LT((info_x - ref_x).norm(), 1e-6) << "trial " << trial;
+        EXPECT_LT((info_Sigma - ref_Sigma).norm(), 1e-6) << "trial " << trial;
+    }
+}
+
+TEST(PoseUpdate, NoInformationIsRejected) {
+    srand(5);
+    Eigen::Matrix<double, 15, 15> Sigma = random_spd<15>(0.01, 1.0);
+    Eigen::Matrix<double, 6, 1> mean_sample, mean_posterior;
+    Eigen::Matrix<double, 6, 6> cov_sample, cov_posterior;
+    make_moments(Sigma, Eigen::Matrix<double, 6, 1>::Zero(), Eigen::Matrix<double, 6, 6>::Zero(),
+                 mean_sample, cov_sample, mean_posterior, cov_posterior);
+
+    Eigen::Matrix<double, 6, 6> W, cov_meas;
+    Eigen::Matrix<double, 6, 1> z, mean_meas;
+    EXPECT_FALSE(recover_pose_meas(mean_sample, cov_sample, mean_posterior, cov_posterior,
+                                   W, z, mean_meas, cov_meas));
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+#else
 int main(int argc, char **argv)
 {
     // initialize ros
@@ -101,3 +269,4 @@ int main(int argc, char **argv)
 
     ros::spin();
 }
+#endif
@@ -0,0 +1,111 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include "lidar_eskf/particles.h"
+
+// walls, floor and ceiling of a box room
+static const double ROOM_MIN[3] = {-4.0, -3.0, 0.0};
+static const double ROOM_MAX[3] = { 4.0,  3.0, 3.0};
+
+static void write_room(const std::string &file_name, double resolution) {
+    octomap::OcTree tree(resolution);
+    double step = 0.5 * resolution;
+    for(int axis=0; axis<3; axis++) {
+        int u = (axis + 1) % 3, v = (axis + 2) % 3;
+        for(double a=ROOM_MIN[u]; a<=ROOM_MAX[u]; a+=step) {
+            for(double b=ROOM_MIN[v]; b<=ROOM_MAX[v]; b+=step) {
+                double p[3];
+                p[u] = a;
+                p[v] = b;
+                p[axis] = ROOM_MIN[axis];
+                tree.updateNode(octomap::point3d(p[0], p[1], p[2]), true);
+                p[axis] = ROOM_MAX[axis];
+                tree.updateNode(octomap::point3d(p[0], p[1], p[2]), true);
+            }
+        }
+    }
+    tree.updateInnerOccupancy();
+    tree.writeBinary(file_name);
+}
+
+TEST(AngleAxis, ZeroIsIdentity) {
+    Eigen::Matrix3d R = angle_axis_to_rotation_matrix(Eigen::Vector3d::Zero());
+    EXPECT_TRUE(R.allFinite());
+    EXPECT_TRUE(R.isApprox(Eigen::Matrix3d::Identity()));
+}
+
+TEST(RefineProposal, RecoversPlantedOffset) {
+    const std::string file_name = "/tmp/lidar_eskf_proposal_test.bt";
+    write_room(file_name, 0.1);
+
+    ros::NodeHandle nh("~");
+    nh.setParam("map_file_name", file_name);
+    nh.setParam("octree_resolution", 0.1);
+    nh.setParam("max_obstacle_dist", 1.0);
+    nh.setParam("dist_backend", std::string("dense"));
+    nh.setParam("map_async_load", false);
+    nh.setParam("octomap_publish_mode", std::string("full"));
+    boost::shared_ptr<DistMap> map_ptr(new DistMap(nh));
+    ASSERT_TRUE(map_ptr->is_ready());
+
+    // scan of the room from the true pose, in the robot frame
+    Eigen::Quaterniond rotation_true(Eigen::AngleAxisd(0.3, Eigen::Vector3d::UnitZ()));
+    Eigen::Vector3d translation_true(0.5, -0.2, 1.2);
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_ptr(new pcl::PointCloud<pcl::PointXYZ>);
+    srand(1);
+    for(int i=0; i<3000; i++) {
+        Eigen::Vector3d p;
+        for(int k=0; k<3; k++) {
+            p[k] = ROOM_MIN[k] + (ROOM_MAX[k] - ROOM_MIN[k]) * rand() / double(RAND_MAX);
+        }
+        int face = i % 6;
+        p[face / 2] = face % 2 ? ROOM_MAX[face / 2] : ROOM_MIN[face / 2];
+        Eigen::Vector3d q = rotation_true.inverse() * (p - translation_true);
+        cloud_ptr->push_back(pcl::PointXYZ(q.x(), q.y(), q.z()));
+    }
+
+    // prior off by a known error state
+    Eigen::Matrix<double, 6, 1> offset;
+    offset << 0.15, -0.1, 0.05, 0.02, -0.03, 0.06;
+    Eigen::Vector3d translation_prior = translation_true - offset.head<3>();
+    Eigen::Quaterniond rotation_prior = rotation_true *
+        Eigen::Quaterniond(angle_axis_to_rotation_matrix(-offset.tail<3>()));
+    Eigen::Matrix<double, 7, 1> mean_prior;
+    mean_prior << translation_prior, rotation_prior.w(), rotation_prior.x(),
+                  rotation_prior.y(), rotation_prior.z();
+    Eigen::Matrix<double, 6, 6> cov_prior = 0.04 * Eigen::Matrix<double, 6, 6>::Identity();
+
+    Particles particles(map_ptr);
+    particles.set_raysigma(0.2);
+    particles.set_size(100);
+    particles.set_mean(mean_prior);
+    particles.set_cov(cov_prior);
+    particles.set_cloud(cloud_ptr);
+    ASSERT_TRUE(particles.refine_proposal(10, 1.0));
+
+    Eigen::Matrix<double, 6, 1> mean;
+    Eigen::Matrix<double, 6, 6> cov;
+    ASSERT_TRUE(particles.get_proposal(mean, cov));
+    Eigen::AngleAxisd rotation_err(rotation_prior.inverse() * rotation_true);
+    Eigen::Vector3d theta = rotation_err.angle() * rotation_err.axis();
+    for(int k=0; k<3; k++) {
+        EXPECT_NEAR(mean[k], offset[k], 0.02);
+        EXPECT_NEAR(mean[3 + k], theta[k], 0.01);
+    }
+    EXPECT_LT(cov.trace(), 0.01 * cov_prior.trace());
+
+    std::remove(file_name.c_str());
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    ros::init(argc, argv, "proposal_test");
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,155 @@
+/*
+* Copyright (c) 2016 Carnegie Mellon University, Weikun Zhen <weikunz@andrew.cmu.edu>
+*
+* For License information please see the LICENSE file in the root directory.
+*
+*/
+
+#include <gtest/gtest.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "lidar_eskf/voxel_cache.h"
+
+// octree style key of a voxel
+static boost::uint64_t make_key(boost::uint64_t x, boost::uint64_t y, boost::uint64_t z) {
+    return x | y << 16 | z << 32;
+}
+
+// value every thread stores for a key, so that a wrong pairing shows
+static float value_of(boost::uint64_t key) {
+    return -float(key % 100003) * 0.001f;
+}
+
+class VoxelCacheTest : public testing::Test
+{
+protected:
+    // leave the slot of key as if an insert had claimed it and not yet
+    // published the value
+    static void claim(VoxelCache &cache, boost::uint64_t key, float stale) {
+        size_t s = cache.slot(key);
+        cache._values[s].store(stale);
+        cache._keys[s].store(key | cache._epoch | VoxelCache::BUSY);
+    }
+    static boost::uint64_t epoch(const VoxelCache &cache) { return cache._epoch; }
+};
+
+TEST_F(VoxelCacheTest, InsertFind) {
+    VoxelCache cache(10);
+    float v;
+    boost::uint64_t key = make_key(3, 4, 5);
+    EXPECT_FALSE(cache.find(key, v));
+    cache.insert(key, -1.5f);
+    ASSERT_TRUE(cache.find(key, v));
+    EXPECT_EQ(-1.5f, v);
+    cache.insert(key, -2.5f);
+    ASSERT_TRUE(cache.find(key, v));
+    EXPECT_EQ(-2.5f, v);
+
+    cache.insert(VoxelCache::NO_KEY, -1.0f);
+    EXPECT_FALSE(cache.find(VoxelCache::NO_KEY, v));
+    cache.insert(VoxelCache::KEY_MASK + 1, -1.0f);
+    EXPECT_FALSE(cache.find(VoxelCache::KEY_MASK + 1, v));
+}
+
+TEST_F(VoxelCacheTest, BusySlotIsMiss) {
+    VoxelCache cache(10);
+    float v;
+    boost::uint64_t key = make_key(7, 8, 9);
+    claim(cache, key, -9.0f);
+    EXPECT_FALSE(cache.find(key, v));
+    // an insert of the same voxel leaves the slot to its owner
+    cache.insert(key, -1.0f);
+    EXPECT_FALSE(cache.find(key, v));
+
+    // a slot claimed in an earlier scan is free again
+    cache.new_scan();
+    EXPECT_FALSE(cache.find(key, v));
+    cache.insert(key, -1.0f);
+    ASSERT_TRUE(cache.find(key, v));
+    EXPECT_EQ(-1.0f, v);
+}
+
+TEST_F(VoxelCacheTest, NewScanInvalidates) {
+    VoxelCache cache(8);
+    float v;
+    for(int scan=0; scan<50; scan++) {
+        for(boost::uint64_t x=0; x<64; x++) {
+            boost::uint64_t key = make_key(x, scan, 1);
+            cache.insert(key, value_of(key));
+        }
+        for(boost::uint64_t x=0; x<64; x++) {
+            boost::uint64_t key = make_key(x, scan, 1);
+            if(cache.find(key, v)) {
+                EXPECT_EQ(value_of(key), v);
+            }
+            if(scan > 0) {
+                EXPECT_FALSE(cache.find(make_key(x, scan - 1, 1), v));
+            }
+        }
+        cache.new_scan();
+    }
+}
+
+TEST_F(VoxelCacheTest, EpochWraparound) {
+    VoxelCache cache(8);
+    float v;
+    boost::uint64_t key = make_key(1, 2, 3);
+    boost::uint64_t first = epoch(cache);
+    cache.insert(key, -1.0f);
+
+    // every 15 bit epoch but zero is used once before the first comes back
+    int scans = 0;
+    do {
+        cache.new_scan();
+        scans++;
+        ASSERT_NE(0u, epoch(cache));
+        ASSERT_LE(scans, 1 << 15);
+    } while(epoch(cache) != first);
+    EXPECT_EQ((1 << 15) - 1, scans);
+
+    // the slot of the first scan must not match again
+    EXPECT_FALSE(cache.find(key, v));
+    cache.insert(key, -2.0f);
+    ASSERT_TRUE(cache.find(key, v));
+    EXPECT_EQ(-2.0f, v);
+}
+
+TEST_F(VoxelCacheTest, ConcurrentInsertFind) {
+    VoxelCache cache(12);
+    const int num_keys = 3000;
+    const int num_ops = 200000;
+    for(int scan=0; scan<5; scan++) {
+        int wrong = 0, hits = 0;
+        #pragma omp parallel for reduction(+:wrong,hits)
+        for(int i=0; i<num_ops; i++) {
+            unsigned h = unsigned(i) * 2654435761u + unsigned(scan);
+            boost::uint64_t key = make_key(h % num_keys, scan, 0);
+            float v;
+            if(cache.find(key, v)) {
+                hits++;
+                if(v != value_of(key)) wrong++;
+            } else {
+                cache.insert(key, value_of(key));
+            }
+        }
+        EXPECT_EQ(0, wrong) << "scan " << scan;
+        EXPECT_GT(hits, 0) << "scan " << scan;
+
+        // once the writers are done every cached key has its own value
+        for(int k=0; k<num_keys; k++) {
+            boost::uint64_t key = make_key(k, scan, 0);
+            float v;
+            if(cache.find(key, v)) {
+                EXPECT_EQ(value_of(key), v);
+            }
+        }
+        cache.new_scan();
+    }
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}